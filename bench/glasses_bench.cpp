@@ -0,0 +1,377 @@
+/*
+ * glasses_bench.cpp for CraftOS-PC plugins
+ * Times scene building, the Lua bindings, triangulation and rendering of the glasses plugin on a headless renderer.
+ * Scenes of dots, rectangles, lines, polygons or text are built through the real object classes, and a few objects are changed every frame.
+ * "-k capture" checks captures from several renderers while the render loop is running, since they share the geometry workers.
+ * "-k damage" checks that changing one primitive of a populated layer only damages the area of that primitive.
+ * Linux: g++ -O2 -pthread -o bench/glasses_bench bench/glasses_bench.cpp -lSDL2_ttf -lSDL2_gfx -lSDL2 -lcraftos2-lua
+ * Usage: glasses_bench [-n max_objects] [-k kind] [-f frames] [-m changes] [-j threads] [-t seconds]
+ * Licensed under the MIT license.
+ */
+
+#include "../glasses.cpp"
+#include <lualib.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+using namespace objects::object2d;
+
+// Every C++ allocation is counted, including those of the worker threads. SDL's own allocations aren't.
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void * ptr = malloc(size ? size : 1);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept {free(ptr);}
+void operator delete(void* ptr, size_t) noexcept {free(ptr);}
+
+enum class Kind {Dots, Rectangles, Lines, Polygons, Text};
+
+struct KindName {
+    Kind kind;
+    const char * name;
+    long maxObjects; // text takes too much memory beyond this
+    const char * type; // addObjects type name
+    const char * method; // Group2D method
+    const char * args; // arguments of both, in terms of x, y and star(x, y)
+};
+
+static const KindName kinds[] = {
+    {Kind::Dots, "dots", 100000, "dot", "addDot", "{x, y}, 0xFF8000FF, 2"},
+    {Kind::Rectangles, "rectangles", 100000, "rectangle", "addRectangle", "x, y, 16, 12, 0x40C0FF80"},
+    {Kind::Lines, "lines", 100000, "line", "addLine", "{x, y}, {x + 20, y + 10}, 0x80FF40FF, 2"},
+    {Kind::Polygons, "polygons", 100000, "polygon", "addPolygon", "star(x, y), 0xC040FFFF"},
+    {Kind::Text, "text", 10000, "text", "addText", "{x, y}, \"Hello, world\", 0xFFFFFFFF, 12"}
+};
+
+static const long objectCounts[] = {100, 1000, 10000, 100000};
+static const long vertexCounts[] = {8, 32, 100, 1000, 10000};
+
+// Builds the same scene as one object per call, or with addObjects followed by looking up every handle.
+static const char luaScene[] =
+    "local canvas, n, batch, w, h = ...\n"
+    "local random = math.random\n"
+    "math.randomseed(1)\n"
+    "local function star(x, y)\n"
+    "  local points = {}\n"
+    "  for i = 0, 7 do\n"
+    "    local r = i %% 2 == 0 and 12 or 5\n"
+    "    points[i + 1] = {x + math.floor(r * math.cos(i * math.pi / 4)), y + math.floor(r * math.sin(i * math.pi / 4))}\n"
+    "  end\n"
+    "  return points\n"
+    "end\n"
+    "if batch then\n"
+    "  local objects = {}\n"
+    "  for i = 1, n do local x, y = random(0, w - 1), random(0, h - 1); objects[i] = {\"%s\", %s} end\n"
+    "  local list = canvas.addObjects(objects)\n"
+    "  for i = 1, #list do local obj = list[i] end\n"
+    "else\n"
+    "  for i = 1, n do local x, y = random(0, w - 1), random(0, h - 1); canvas.%s(%s) end\n"
+    "end\n";
+
+// The renderer only uses its computer for the handle table, so only the userdata maps of the computer are constructed.
+alignas(Computer) static unsigned char computerStorage[sizeof(Computer)];
+
+static Computer * fakeComputer() {
+    Computer * comp = (Computer*)computerStorage;
+    new (&comp->userdata) decltype(comp->userdata)();
+    new (&comp->userdata_destructors) decltype(comp->userdata_destructors)();
+    return comp;
+}
+
+static double seconds(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void star(std::vector<SDL_Point>& points, SDL_Point center, long n, double outer, double inner) {
+    points.resize(n);
+    for (long i = 0; i < n; i++) {
+        const double a = 2.0 * M_PI * i / n, r = i % 2 ? inner : outer;
+        points[i] = {center.x + (int)floor(r * cos(a)), center.y + (int)floor(r * sin(a))};
+    }
+}
+
+static objects::BaseObject * addObject(Frame2D * canvas, Kind kind, SDL_Point pos, std::vector<SDL_Point>& points) {
+    static const std::string text = "Hello, world";
+    switch (kind) {
+    case Kind::Dots: return PrimitiveLayer::getFacade(canvas->addDot(pos, 0xFF8000FF, 2));
+    case Kind::Rectangles: return PrimitiveLayer::getFacade(canvas->addRectangle(pos.x, pos.y, 16, 12, 0x40C0FF80));
+    case Kind::Lines: return PrimitiveLayer::getFacade(canvas->addLine(pos, {pos.x + 20, pos.y + 10}, 0x80FF40FF, 2));
+    case Kind::Polygons:
+        star(points, pos, 8, 12.0, 5.0);
+        return canvas->addPolygon(points, 0xC040FFFF);
+    case Kind::Text: return canvas->addText(pos, text, 0xFFFFFFFF, 12);
+    }
+    return NULL;
+}
+
+static void setColor(objects::BaseObject * obj, Kind kind, unsigned int color) {
+    switch (kind) {
+    case Kind::Dots: static_cast<Dot*>(obj)->setColor(color); break;
+    case Kind::Rectangles: static_cast<Rectangle*>(obj)->setColor(color); break;
+    case Kind::Lines: static_cast<Line*>(obj)->setColor(color); break;
+    case Kind::Polygons: static_cast<Polygon*>(obj)->setColor(color); break;
+    case Kind::Text: static_cast<Text*>(obj)->setColor(color); break;
+    }
+}
+
+// Runs the Lua scene script on the canvas, and returns the time it took.
+static double runLua(lua_State *L, GlassesRenderer * ren, const KindName& kind, long n, bool batch) {
+    char script[sizeof(luaScene) + 256];
+    snprintf(script, sizeof(script), luaScene, kind.type, kind.args, kind.method, kind.args);
+    if (luaL_loadstring(L, script)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(2);
+    }
+    ren->canvas2d->pushLua(L);
+    lua_pushinteger(L, n);
+    lua_pushboolean(L, batch);
+    lua_pushinteger(L, WIDTH);
+    lua_pushinteger(L, HEIGHT);
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    if (lua_pcall(L, 5, 0, 0)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(2);
+    }
+    const double elapsed = seconds(start);
+    ren->canvas2d->clear();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return elapsed;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+static void runScene(Computer * comp, const KindName& kind, long n, int frames, int changes) {
+    std::mt19937 rng(1);
+    std::vector<SDL_Point> positions(n), points;
+    for (SDL_Point& p : positions) p = {(int)(rng() % WIDTH), (int)(rng() % HEIGHT)};
+    std::vector<objects::BaseObject*> objs(n);
+    GlassesRenderer * ren = new GlassesRenderer(comp, "bench", true);
+
+    size_t allocs = allocations;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for (long i = 0; i < n; i++) objs[i] = addObject(ren->canvas2d, kind.kind, positions[i], points);
+    const double build = seconds(start);
+    const double buildAllocs = (double)(allocations - allocs) / n;
+
+    start = std::chrono::high_resolution_clock::now();
+    ren->render();
+    const double first = seconds(start);
+
+    std::vector<double> times;
+    times.reserve(frames);
+    allocs = allocations;
+    for (int f = 0; f < frames; f++) {
+        for (int c = 0; c < changes; c++) setColor(objs[rng() % n], kind.kind, rng() | 0xFF);
+        start = std::chrono::high_resolution_clock::now();
+        ren->render();
+        times.push_back(seconds(start));
+    }
+    const double frameAllocs = frames ? (double)(allocations - allocs) / frames : 0.0;
+    std::sort(times.begin(), times.end());
+    ren->canvas2d->clear();
+
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    const double lua = runLua(L, ren, kind, n, false);
+    const double batch = runLua(L, ren, kind, n, true);
+    lua_close(L);
+    delete ren;
+
+    printf("%-10s %7ld %10.3f %8.1f %10.3f %10.3f %10.3f", kind.name, n, build * 1000.0, buildAllocs, lua * 1000.0, batch * 1000.0, first * 1000.0);
+    if (frames) printf(" %8.3f %8.3f %8.3f %8.3f %10.1f\n", percentile(times, 0.5) * 1000.0, percentile(times, 0.9) * 1000.0,
+        percentile(times, 0.99) * 1000.0, times.back() * 1000.0, frameAllocs);
+    else printf("\n");
+}
+
+// Times the plugin's triangulation (including the convex fast path) on its own.
+static void runTriangulation(long maxVertices, double limit) {
+    printf("%-8s %8s %8s %12s %10s %10s\n", "shape", "vertices", "runs", "time (us)", "triangles", "allocs");
+    for (int convex = 1; convex >= 0; convex--) {
+        for (long n : vertexCounts) {
+            if (n > maxVertices) continue;
+            std::vector<SDL_Point> points;
+            star(points, {0, 0}, n, 1000.0, convex ? 1000.0 : 400.0);
+            std::vector<SDL_FPoint> tris;
+            int runs = 0;
+            const size_t allocs = allocations;
+            std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+            double elapsed;
+            do {
+                triangulate(points, tris);
+                runs++;
+                elapsed = seconds(start);
+            } while (elapsed < limit);
+            printf("%-8s %8ld %8d %12.2f %10zu %10.1f\n", convex ? "convex" : "star", n, runs, elapsed * 1000000.0 / runs, tris.size() / 3,
+                (double)(allocations - allocs) / runs);
+        }
+    }
+}
+
+// Captures from a few renderers on their own threads while another thread keeps rendering all of them, like
+// computers calling capture() during the render loop. Every capture recolors all polygons first, so both the
+// captures and the render loop rebuild enough geometry to use the worker pool; any pixel of the wrong color
+// means the builds got mixed up. Returns the number of wrong pixels.
+static long runCaptures(Computer * comp, int renderers, long n, double limit) {
+    std::vector<GlassesRenderer*> targets;
+    std::vector<std::vector<Polygon*>> polygons(renderers);
+    std::vector<std::vector<SDL_Point>> centers(renderers);
+    std::mt19937 rng(1);
+    std::vector<SDL_Point> points;
+    for (int r = 0; r < renderers; r++) {
+        targets.push_back(new GlassesRenderer(comp, "capture", true));
+        for (long i = 0; i < n; i++) {
+            const SDL_Point pos = {12 + (int)(rng() % (WIDTH - 24)), 12 + (int)(rng() % (HEIGHT - 24))};
+            star(points, pos, 8, 12.0, 5.0);
+            polygons[r].push_back(targets[r]->canvas2d->addPolygon(points, 0xFFFFFFFF));
+            centers[r].push_back(pos);
+        }
+    }
+
+    std::atomic<bool> running(true);
+    std::atomic<long> frames(0), captures(0), wrong(0);
+    std::thread renderLoop([&]() {
+        while (running)
+            for (GlassesRenderer * ren : targets)
+                if (ren->isDirty() && ren->render()) frames++;
+    });
+    std::vector<std::thread> capturers;
+    for (int r = 0; r < renderers; r++) {
+        capturers.push_back(std::thread([&, r]() {
+            std::mt19937 crng(r + 1);
+            std::vector<Uint8> pixels;
+            std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+            do {
+                const unsigned int color = (crng() & 0xFFFFFF00) | 0xFF;
+                for (Polygon * p : polygons[r]) p->setColor(color);
+                if (!targets[r]->capture(pixels)) {
+                    fprintf(stderr, "Could not capture: %s\n", SDL_GetError());
+                    exit(2);
+                }
+                captures++;
+                for (const SDL_Point& c : centers[r]) {
+                    const Uint8 * px = &pixels[(c.y * WIDTH + c.x) * 4];
+                    if (((unsigned int)px[0] << 24 | (unsigned int)px[1] << 16 | (unsigned int)px[2] << 8 | 0xFF) != color) wrong++;
+                }
+            } while (seconds(start) < limit);
+        }));
+    }
+    for (std::thread& t : capturers) t.join();
+    running = false;
+    renderLoop.join();
+    for (GlassesRenderer * ren : targets) delete ren;
+
+    printf("%ld capture(s) from %d renderer(s) of %ld polygons during %ld frame(s) of the render loop: %ld wrong pixel(s)\n",
+        (long)captures, renderers, n, (long)frames, (long)wrong);
+    return wrong;
+}
+
+// Changes single dots and rectangles of a layer full of them, and checks that the next frame only damages what
+// the changed primitive covered before and after. Returns the number of checks that damaged more.
+static long runDamage(Computer * comp, long n) {
+    GlassesRenderer * ren = new GlassesRenderer(comp, "damage", true);
+    std::mt19937 rng(1);
+    std::vector<SDL_Point> points;
+    std::vector<objects::BaseObject*> dots, rectangles;
+    for (long i = 0; i < n; i++) {
+        const SDL_Point pos = {(int)(rng() % WIDTH), (int)(rng() % HEIGHT)};
+        if (i % 2) rectangles.push_back(addObject(ren->canvas2d, Kind::Rectangles, pos, points));
+        else dots.push_back(addObject(ren->canvas2d, Kind::Dots, pos, points));
+    }
+    ren->updateGeometry(ren->canvas2d);
+    ren->canvas2d->takeDamage();
+
+    long failed = 0;
+    const auto check = [&](const char * what, size_t maxRects, long maxArea) {
+        ren->updateGeometry(ren->canvas2d);
+        const std::vector<SDL_Rect> damage = ren->canvas2d->takeDamage();
+        long area = 0;
+        for (const SDL_Rect& r : damage) area += (long)r.w * r.h;
+        printf("%-22s %5zu %10ld %10ld\n", what, damage.size(), area, maxArea);
+        if (damage.empty() || damage.size() > maxRects || area > maxArea) failed++;
+    };
+    // A dot of size 2 covers 5x5 pixels and a 16x12 rectangle 17x13, with a pixel of slack for rounding.
+    printf("%-22s %5s %10s %10s\n", "change", "rects", "area", "limit");
+    for (int i = 0; i < 4; i++) {
+        setColor(dots[rng() % dots.size()], Kind::Dots, rng() | 0xFF);
+        check("dot setColor", 1, 6 * 6);
+        setColor(rectangles[rng() % rectangles.size()], Kind::Rectangles, rng() | 0xFF);
+        check("rectangle setColor", 1, 18 * 14);
+        Dot * dot = static_cast<Dot*>(dots[rng() % dots.size()]);
+        const SDL_Point pos = dot->getPosition();
+        dot->setPosition({(pos.x + WIDTH / 2) % WIDTH, (pos.y + HEIGHT / 2) % HEIGHT});
+        check("dot setPosition", 2, 2 * 6 * 6);
+    }
+    delete ren;
+    printf("%ld check(s) of %ld primitives damaged too much\n", failed, n);
+    return failed;
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr, "Usage: %s [-n max_objects] [-k kind] [-f frames] [-m changes] [-j threads] [-t seconds]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, const char * argv[]) {
+    long maxObjects = 100000;
+    int frames = 100, changes = 10, threads = std::min(std::max((int)std::thread::hardware_concurrency() - 1, 0), 7);
+    double limit = 0.1;
+    std::string kindFilter;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        if (arg == "-n") maxObjects = atol(argv[++i]);
+        else if (arg == "-k") kindFilter = argv[++i];
+        else if (arg == "-f") frames = atoi(argv[++i]);
+        else if (arg == "-m") changes = atoi(argv[++i]);
+        else if (arg == "-j") threads = atoi(argv[++i]);
+        else if (arg == "-t") limit = atof(argv[++i]);
+        else usage(argv[0]);
+    }
+    if (maxObjects < 1 || frames < 0 || changes < 0 || threads < 0 || limit < 0.0) usage(argv[0]);
+    if (TTF_Init() < 0) {
+        fprintf(stderr, "Could not initialize SDL_ttf: %s\n", SDL_GetError());
+        return 2;
+    }
+    if (threads) geometryPool = new WorkerPool(threads);
+    Computer * comp = fakeComputer();
+
+    long wrong = 0;
+    if (kindFilter == "capture") {
+        printf("Capturing %dx%d headless with %d worker thread(s)\n\n", WIDTH, HEIGHT, threads);
+        wrong = runCaptures(comp, 2, std::min(maxObjects, 1000L), limit);
+    } else if (kindFilter == "damage") {
+        printf("Damage of single changes %dx%d headless\n\n", WIDTH, HEIGHT);
+        wrong = runDamage(comp, std::min(maxObjects, 10000L));
+    } else {
+        printf("Rendering %dx%d headless with %d worker thread(s), %d frame(s) changing %d object(s) each\n\n", WIDTH, HEIGHT, threads, frames, changes);
+        printf("%-10s %7s %10s %8s %10s %10s %10s %8s %8s %8s %8s %10s\n", "kind", "objects", "build (ms)", "allocs", "lua (ms)", "batch (ms)",
+            "first (ms)", "p50", "p90", "p99", "max", "allocs/frm");
+        for (const KindName& kind : kinds) {
+            if (!kindFilter.empty() && kindFilter != kind.name) continue;
+            for (long n : objectCounts)
+                if (n <= maxObjects && n <= kind.maxObjects) runScene(comp, kind, n, frames, changes);
+        }
+        if (kindFilter.empty() || kindFilter == "triangulation") {
+            printf("\n");
+            runTriangulation(maxObjects, limit);
+        }
+    }
+
+    for (auto& d : comp->userdata_destructors) d.second(comp, d.first, comp->userdata[d.first]);
+    delete geometryPool;
+    TTF_Quit();
+    return wrong ? 3 : 0;
+}
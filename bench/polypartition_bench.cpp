@@ -0,0 +1,183 @@
+/*
+ * polypartition_bench.cpp for CraftOS-PC plugins
+ * Checks and times the algorithms of the vendored polypartition library, which is used by the glasses plugin.
+ * Polygons of several shapes and sizes are generated; each result must cover the area of the polygon exactly.
+ * Linux: g++ -O2 -o bench/polypartition_bench bench/polypartition_bench.cpp
+ * Usage: polypartition_bench [-n max_vertices] [-a algorithm] [-s shape] [-t seconds]
+ * Licensed under the MIT license.
+ */
+
+#include "../polypartition.cpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+enum class Shape {Convex, Star, Spiral, Holed};
+
+struct ShapeName {
+    Shape shape;
+    const char * name;
+    long minVertices;
+};
+
+struct Algorithm {
+    const char * name;
+    long maxVertices; // keeps the slow algorithms from running for hours at the default sizes
+    bool holes;
+    bool triangulates;
+    int (*run)(TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output);
+};
+
+static const ShapeName shapes[] = {
+    {Shape::Convex, "convex", 3},
+    {Shape::Star, "star", 4},
+    {Shape::Spiral, "spiral", 8},
+    {Shape::Holed, "holed", 6}
+};
+
+// The single-polygon variants are used for algorithms that don't support holes.
+static const Algorithm algorithms[] = {
+    {"Triangulate_EC", 10000, true, true, [](TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output) {return part.Triangulate_EC(&input, &output);}},
+    {"Triangulate_OPT", 1000, false, true, [](TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output) {return part.Triangulate_OPT(&input.front(), &output);}},
+    {"Triangulate_MONO", 100000, true, true, [](TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output) {return part.Triangulate_MONO(&input, &output);}},
+    {"ConvexPartition_HM", 1000, true, false, [](TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output) {return part.ConvexPartition_HM(&input, &output);}},
+    {"ConvexPartition_OPT", 300, false, false, [](TPPLPartition& part, TPPLPolyList& input, TPPLPolyList& output) {return part.ConvexPartition_OPT(&input.front(), &output);}}
+};
+
+static const long vertexCounts[] = {3, 10, 100, 1000, 10000, 100000};
+
+static void circle(TPPLPoly& poly, long n, double radius, bool clockwise) {
+    poly.Init(n);
+    for (long i = 0; i < n; i++) {
+        const double a = 2.0 * M_PI * (clockwise ? n - i : i) / n;
+        poly[i] = {radius * cos(a), radius * sin(a)};
+    }
+}
+
+// Generates a counter-clockwise polygon (plus a clockwise hole for the holed shape) with about n vertices.
+static void generate(Shape shape, long n, TPPLPolyList& polys) {
+    polys.clear();
+    TPPLPoly poly;
+    switch (shape) {
+    case Shape::Convex:
+        circle(poly, n, 1000.0, false);
+        break;
+    case Shape::Star:
+        poly.Init(n);
+        for (long i = 0; i < n; i++) {
+            const double a = 2.0 * M_PI * i / n, r = i % 2 ? 400.0 : 1000.0;
+            poly[i] = {r * cos(a), r * sin(a)};
+        }
+        break;
+    case Shape::Spiral: {
+        // A strip wound around the center, which is very concave everywhere.
+        // Points are kept dense enough along the turns that the edges of neighbouring turns never cross.
+        const long m = n / 2;
+        const double turns = std::max(0.25, std::min(3.0, m / 32.0));
+        poly.Init(m * 2);
+        for (long i = 0; i < m; i++) {
+            const double t = (double)i / (m - 1), a = turns * 2.0 * M_PI * t, r = 200.0 + 600.0 * t;
+            poly[i] = {(r + 40.0) * cos(a), (r + 40.0) * sin(a)};
+            poly[m * 2 - 1 - i] = {(r - 40.0) * cos(a), (r - 40.0) * sin(a)};
+        }
+        poly.SetOrientation(TPPL_ORIENTATION_CCW);
+        break;
+    } case Shape::Holed: {
+        TPPLPoly hole;
+        circle(poly, n - n / 2, 1000.0, false);
+        circle(hole, n / 2, 500.0, true);
+        hole.SetHole(true);
+        polys.push_back(poly);
+        polys.push_back(hole);
+        return;
+    }}
+    polys.push_back(poly);
+}
+
+static double area(const TPPLPoly& poly) {
+    double a = 0.0;
+    for (long i = 0, n = poly.GetNumPoints(); i < n; i++) {
+        const TPPLPoint& p = poly.GetPoint(i), &q = poly.GetPoint((i + 1) % n);
+        a += p.x * q.y - q.x * p.y;
+    }
+    return a / 2.0;
+}
+
+// Checks that the parts cover the polygon: their areas must add up, and triangulations must contain n - 2 + 2 * holes triangles.
+static bool verify(const Algorithm& alg, TPPLPolyList& input, TPPLPolyList& output) {
+    double expected = 0.0, actual = 0.0;
+    long vertices = 0, holes = 0;
+    for (const TPPLPoly& poly : input) {
+        expected += area(poly);
+        vertices += poly.GetNumPoints();
+        if (poly.IsHole()) holes++;
+    }
+    for (const TPPLPoly& poly : output) {
+        if (alg.triangulates && poly.GetNumPoints() != 3) return false;
+        actual += fabs(area(poly));
+    }
+    if (alg.triangulates && (long)output.size() != vertices - 2 + 2 * holes) return false;
+    return fabs(actual - expected) <= fabs(expected) * 1e-6;
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr, "Usage: %s [-n max_vertices] [-a algorithm] [-s shape] [-t seconds]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, const char * argv[]) {
+    long maxVertices = 100000;
+    double seconds = 0.1;
+    std::string algorithmFilter, shapeFilter;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        if (arg == "-n") maxVertices = atol(argv[++i]);
+        else if (arg == "-a") algorithmFilter = argv[++i];
+        else if (arg == "-s") shapeFilter = argv[++i];
+        else if (arg == "-t") seconds = atof(argv[++i]);
+        else usage(argv[0]);
+    }
+    if (maxVertices < 3 || seconds < 0.0) usage(argv[0]);
+
+    int failures = 0;
+    printf("%-8s %8s %-20s %8s %12s %10s %s\n", "shape", "vertices", "algorithm", "runs", "time (ms)", "parts", "result");
+    for (const ShapeName& shape : shapes) {
+        if (!shapeFilter.empty() && shapeFilter != shape.name) continue;
+        for (long n : vertexCounts) {
+            if (n > maxVertices || n < shape.minVertices) continue;
+            TPPLPolyList input;
+            generate(shape.shape, n, input);
+            long vertices = 0;
+            for (const TPPLPoly& poly : input) vertices += poly.GetNumPoints();
+            for (const Algorithm& alg : algorithms) {
+                if (!algorithmFilter.empty() && algorithmFilter != alg.name) continue;
+                if (n > alg.maxVertices || (shape.shape == Shape::Holed && !alg.holes)) continue;
+                TPPLPartition part;
+                TPPLPolyList output;
+                // Repeat small inputs until the time is measurable.
+                int runs = 0, ok = 1;
+                std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+                double elapsed;
+                do {
+                    output.clear();
+                    ok = alg.run(part, input, output);
+                    runs++;
+                    elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start).count();
+                } while (ok && elapsed < seconds);
+                const bool valid = ok && verify(alg, input, output);
+                if (!valid) failures++;
+                printf("%-8s %8ld %-20s %8d %12.4f %10zu %s\n", shape.name, vertices, alg.name, runs, elapsed * 1000.0 / runs, output.size(),
+                    !ok ? "FAILED" : valid ? "ok" : "WRONG AREA");
+            }
+        }
+    }
+    if (failures) printf("\n%d test(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
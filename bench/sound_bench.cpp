@@ -0,0 +1,147 @@
+/*
+ * sound_bench.cpp for CraftOS-PC plugins
+ * Measures the rendering throughput of the sound plugin's synthesizer without an audio device.
+ * The synthesis code from sound.cpp is driven by a fake mixer callback that calls the channel effects like SDL_mixer would.
+ * Linux: g++ -O2 -o bench/sound_bench bench/sound_bench.cpp
+ * Usage: sound_bench [-t seconds] [-r rate] [-o outputs] [-w wave] [-f format] [-c channels]
+ * Licensed under the MIT license.
+ */
+
+#define SOUND_SYNTH_ONLY
+#include "../sound.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct FormatName {
+    Uint16 format;
+    const char * name;
+};
+
+struct WaveName {
+    WaveType type;
+    const char * name;
+};
+
+static const FormatName formats[] = {
+    {AUDIO_S8, "s8"},
+    {AUDIO_U8, "u8"},
+    {AUDIO_S16LSB, "s16lsb"},
+    {AUDIO_S16MSB, "s16msb"},
+    {AUDIO_U16LSB, "u16lsb"},
+    {AUDIO_U16MSB, "u16msb"},
+    {AUDIO_S32LSB, "s32lsb"},
+    {AUDIO_S32MSB, "s32msb"},
+    {AUDIO_F32LSB, "f32lsb"},
+    {AUDIO_F32MSB, "f32msb"}
+};
+
+static const WaveName waves[] = {
+    {WaveType::None, "none"},
+    {WaveType::Sine, "sine"},
+    {WaveType::Triangle, "triangle"},
+    {WaveType::Sawtooth, "sawtooth"},
+    {WaveType::RSawtooth, "rsawtooth"},
+    {WaveType::Square, "square"},
+    {WaveType::Noise, "noise"},
+    {WaveType::Custom, "custom"},
+    {WaveType::PitchedNoise, "pitched_noise"}
+};
+
+static const int channelCounts[] = {4, 8, 16, 32, 64, 128, 256};
+
+// Size of one mixer callback in sample frames (a typical SDL_mixer buffer size).
+static const int chunkFrames = 1024;
+
+static void setupChannel(ChannelInfo * info, int id, int count, WaveType type, InterpolationMode interp) {
+    info->id = id;
+    info->channelCount = count;
+    info->wavetype = type;
+    info->interpolation = interp;
+    // Spread the channels over a few octaves so they don't all wrap around at the same time.
+    info->frequency = 110 + 37 * id;
+    info->amplitude = 0.5;
+    info->pan = (id % 3 - 1) * 0.5;
+    if (type == WaveType::Custom) {
+        info->customWaveSize = 32;
+        for (int i = 0; i < 32; i++) info->customWave[i] = sin(2.0 * M_PI * i / 32.0);
+    } else if (type == WaveType::PitchedNoise) {
+        info->customWaveSize = 512;
+        for (int i = 0; i < 512; i++) info->customWave[i] = ((float)rng() / (float)rng.max()) * 2.0f - 1.0f;
+    }
+}
+
+// Imitates SDL_mixer's channel mixing: each playing channel gets a buffer of silence
+// (the looped empty chunk), which is passed through the registered effect.
+static void fakeMixerCallback(std::vector<ChannelInfo*>& channels, std::vector<Uint8>& buffer) {
+    for (ChannelInfo * info : channels) {
+        memset(buffer.data(), 0, buffer.size());
+        generateWaveform(info, buffer.data(), buffer.size());
+    }
+}
+
+static double runBenchmark(int count, WaveType type, InterpolationMode interp, double seconds) {
+    std::vector<ChannelInfo*> channels;
+    for (int i = 0; i < count; i++) {
+        ChannelInfo * info = new ChannelInfo;
+        setupChannel(info, i, count, type, interp);
+        channels.push_back(info);
+    }
+    std::vector<Uint8> buffer(chunkFrames * (SDL_AUDIO_BITSIZE(targetFormat) / 8) * targetChannels);
+    const int callbacks = (int)ceil(seconds * targetFrequency / chunkFrames);
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < callbacks; i++) fakeMixerCallback(channels, buffer);
+    const double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - start).count();
+    for (ChannelInfo * info : channels) delete info;
+    return elapsed;
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr, "Usage: %s [-t seconds] [-r rate] [-o outputs] [-w wave] [-f format] [-c channels]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, const char * argv[]) {
+    double seconds = 0.25;
+    std::string waveFilter, formatFilter;
+    int channelFilter = 0;
+    targetFrequency = 48000;
+    targetChannels = 2;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        if (arg == "-t") seconds = atof(argv[++i]);
+        else if (arg == "-r") targetFrequency = atoi(argv[++i]);
+        else if (arg == "-o") targetChannels = atoi(argv[++i]);
+        else if (arg == "-w") waveFilter = argv[++i];
+        else if (arg == "-f") formatFilter = argv[++i];
+        else if (arg == "-c") channelFilter = atoi(argv[++i]);
+        else usage(argv[0]);
+    }
+    if (seconds <= 0.0 || targetFrequency <= 0 || targetChannels < 1) usage(argv[0]);
+    rng.seed(0);
+
+    printf("Rendering %g s of audio at %d Hz, %d output channels, %d frames per callback\n\n", seconds, targetFrequency, targetChannels, chunkFrames);
+    printf("%-8s %-14s %-7s %8s %12s %14s %10s\n", "format", "wave", "interp", "channels", "time (ms)", "Msamples/s", "realtime");
+    for (const FormatName& format : formats) {
+        if (!formatFilter.empty() && formatFilter != format.name) continue;
+        targetFormat = format.format;
+        for (const WaveName& wave : waves) {
+            if (!waveFilter.empty() && waveFilter != wave.name) continue;
+            // Interpolation only affects wavetable-based waves.
+            const int interpModes = (wave.type == WaveType::Custom || wave.type == WaveType::PitchedNoise) ? 2 : 1;
+            for (int m = 0; m < interpModes; m++) {
+                InterpolationMode interp = m ? InterpolationMode::Linear : InterpolationMode::None;
+                for (int count : channelCounts) {
+                    if (channelFilter && channelFilter != count) continue;
+                    const double elapsed = runBenchmark(count, wave.type, interp, seconds);
+                    const double samples = ceil(seconds * targetFrequency / chunkFrames) * chunkFrames * count;
+                    printf("%-8s %-14s %-7s %8d %12.3f %14.2f %9.1fx\n", format.name, wave.name, m ? "linear" : "none", count,
+                        elapsed * 1000.0, samples / elapsed / 1000000.0, seconds / elapsed);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -33,19 +33,113 @@ extern "C" {
 #include <lua.h>
 #include <lauxlib.h>
 }
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <new>
 #include <thread>
+#include <vector>
 #include <CraftOS-PC.hpp>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL2_gfxPrimitives.h>
 #include <SDL2/SDL_ttf.h>
 #include "font.h"
+
+// Bump allocator for the temporary storage of polygon triangulation.
+// Memory is never freed individually: reset() makes the blocks available for the next triangulation,
+// so once the arena has grown to the size of the largest polygon, triangulating does no heap allocations.
+class TriangulationArena {
+    std::vector<std::pair<char*, size_t>> blocks;
+    size_t block = 0, offset = 0;
+public:
+    ~TriangulationArena() {
+        for (auto& b : blocks) free(b.first);
+    }
+    void* allocate(size_t size) {
+        size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        for (; block < blocks.size(); block++, offset = 0) {
+            if (offset + size <= blocks[block].second) {
+                void* p = blocks[block].first + offset;
+                offset += size;
+                return p;
+            }
+        }
+        const size_t sz = std::max(size, blocks.empty() ? (size_t)65536 : blocks.back().second * 2);
+        char* p = (char*)malloc(sz);
+        if (p == NULL) throw std::bad_alloc();
+        blocks.push_back(std::make_pair(p, sz));
+        block = blocks.size() - 1;
+        offset = size;
+        return p;
+    }
+    bool owns(const void* p) const {
+        for (const auto& b : blocks)
+            if (p >= b.first && p < b.first + b.second) return true;
+        return false;
+    }
+    void reset() {
+        if (blocks.size() > 1) {
+            // Merge the blocks into one, so the next triangulation of the same size fits in it.
+            size_t total = 0;
+            for (auto& b : blocks) {
+                total += b.second;
+                free(b.first);
+            }
+            blocks.clear();
+            char* p = (char*)malloc(total);
+            if (p) blocks.push_back(std::make_pair(p, total));
+        }
+        block = offset = 0;
+    }
+};
+
+// The arena used by polypartition on the current thread, or NULL to use the heap.
+static thread_local TriangulationArena * currentArena = NULL;
+
+// Sets the arena for the current thread, and resets it once the scope ends.
+// Anything allocated from the arena must be destroyed before that.
+struct ArenaScope {
+    TriangulationArena& arena;
+    TriangulationArena * previous;
+    ArenaScope(TriangulationArena& a): arena(a), previous(currentArena) {currentArena = &a;}
+    ~ArenaScope() {
+        currentArena = previous;
+        arena.reset();
+    }
+};
+
+template<class T>
+struct ArenaAllocator {
+    typedef T value_type;
+    ArenaAllocator() {}
+    template<class U> ArenaAllocator(const ArenaAllocator<U>&) {}
+    T* allocate(size_t n) {
+        if (currentArena) return (T*)currentArena->allocate(n * sizeof(T));
+        return std::allocator<T>().allocate(n);
+    }
+    void deallocate(T* p, size_t n) {
+        if (currentArena && currentArena->owns(p)) return;
+        std::allocator<T>().deallocate(p, n);
+    }
+    template<class U> bool operator==(const ArenaAllocator<U>&) const {return true;}
+    template<class U> bool operator!=(const ArenaAllocator<U>&) const {return false;}
+};
+
+#define TPPL_ALLOCATOR(T) ArenaAllocator<T>
 #include "polypartition.h"
 #include "polypartition.cpp"
 
-#define POINTERLIST_INDEX 0x196aedc0
+#define HANDLETABLE_INDEX 0x196aedc0
 #define rgba(color) (Uint8)((color >> 24) & 0xFF), (Uint8)((color >> 16) & 0xFF), (Uint8)((color >> 8) & 0xFF), (Uint8)(color & 0xFF)
-#define addLuaMethod(name) lua_pushlightuserdata(L, ptr); \
-    lua_pushcclosure(L, _lua_##name<T>, 1); \
+#define addLuaMethod(name) lua_pushcfunction(L, _lua_##name<T>); \
     lua_setfield(L, -2, #name);
 #define LuaGetMethod(type, name, vartype) \
     template<class T> \
@@ -66,40 +160,495 @@ extern "C" {
         return 0; \
     }
 
-namespace objects {namespace object2d {class Frame2D;}}
+struct GlassesRenderer;
+namespace objects {class BaseObject; namespace object2d {class Frame2D;} namespace object3d {class Canvas3D;}}
 
 struct Item {
     std::string name;
     int damage;
 };
 
-struct pointerlist_t {
-    void* ptr = NULL;
-    pointerlist_t* next = NULL;
+// Maps the handles given to Lua to objects. A handle is a slot index and the generation of that slot.
+// Freeing a slot bumps its generation, so stale handles stop resolving without having to be tracked down,
+// and the slot is reused by the next object.
+class HandleTable {
+    struct Slot {
+        objects::BaseObject * ptr;
+        uint32_t generation;
+        uint32_t nextFree;
+    };
+    std::vector<Slot> slots;
+    uint32_t freeList = NONE;
+public:
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+    uint32_t add(objects::BaseObject * ptr) {
+        uint32_t slot = freeList;
+        if (slot == NONE) {
+            slot = slots.size();
+            slots.push_back({NULL, 0, NONE});
+        } else freeList = slots[slot].nextFree;
+        slots[slot].ptr = ptr;
+        return slot;
+    }
+
+    uint32_t generation(uint32_t slot) const {
+        return slots[slot].generation;
+    }
+
+    objects::BaseObject * get(uint32_t slot, uint32_t generation) const {
+        if (slot >= slots.size() || slots[slot].generation != generation) return NULL;
+        return slots[slot].ptr;
+    }
+
+    void release(uint32_t slot) {
+        slots[slot].ptr = NULL;
+        slots[slot].generation++;
+        slots[slot].nextFree = freeList;
+        freeList = slot;
+    }
+};
+
+// Contents of the userdata given to Lua for an object, a copy of which its bound methods get as their upvalue.
+// The table belongs to the computer, so it outlives any handle in its Lua state.
+struct LuaHandle {
+    HandleTable * table;
+    uint32_t slot;
+    uint32_t generation;
 };
 
-struct GlassesRenderer {
-    SDL_Window * win;
+// One object of an addObjects call. Everything is read and checked before the objects are created.
+struct ObjectDesc {
+    char type; // the type letter of the packed format
+    SDL_Point points[3]; // position, line ends or triangle corners; the size of rectangles
+    unsigned int color;
+    double size; // dot size, line thickness or text scale
+    size_t first, count; // range in the point or text buffer; the number of children of groups
+};
+
+// An object that may not have been created as a C++ object: entries of primitive layers only get one when
+// Lua asks for a handle.
+struct ObjectRef {
+    objects::BaseObject * obj; // the layer, for primitives
+    uint32_t entry; // the entry in the layer, or HandleTable::NONE
+};
+
+struct SceneBatch {
+    std::vector<ObjectDesc> objects; // groups are followed by their children
+    std::vector<SDL_Point> points;
+    std::string text;
+    std::vector<ObjectRef> created;
+    size_t roots = 0;
+
+    void clear() {
+        objects.clear();
+        points.clear();
+        text.clear();
+        created.clear();
+        roots = 0;
+    }
+};
+
+// Counters of one renderer, for profiling scripts. They're updated on the render thread (and the geometry workers)
+// and read from Lua, so they're atomics; sums are kept instead of averages, which only need two loads to compute.
+struct RenderStats {
+    std::atomic<uint64_t> frames, skipped, presents, drawCalls, vertices, glyphs, textLayouts, triangulations;
+    std::atomic<uint64_t> renderTime, presentTime; // microseconds
+    std::atomic<uint32_t> lastRenderTime, maxRenderTime, lastPresentTime, maxPresentTime;
+
+    RenderStats() {reset();}
+    void reset() {
+        for (std::atomic<uint64_t>* c : {&frames, &skipped, &presents, &drawCalls, &vertices, &glyphs, &textLayouts, &triangulations, &renderTime, &presentTime})
+            c->store(0, std::memory_order_relaxed);
+        for (std::atomic<uint32_t>* c : {&lastRenderTime, &maxRenderTime, &lastPresentTime, &maxPresentTime})
+            c->store(0, std::memory_order_relaxed);
+    }
+    // Adds the time since start to a total, and updates the last and maximum times. Only called with the render lock held.
+    static void time(std::chrono::steady_clock::time_point start, std::atomic<uint64_t>& total, std::atomic<uint32_t>& last, std::atomic<uint32_t>& max) {
+        const uint32_t us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        total.fetch_add(us, std::memory_order_relaxed);
+        last.store(us, std::memory_order_relaxed);
+        if (us > max.load(std::memory_order_relaxed)) max.store(us, std::memory_order_relaxed);
+    }
+};
+
+// Holds every glyph of one font size that has been drawn so far in a single texture.
+// Glyphs are rasterized in white once, and colored through the vertex colors when drawn.
+struct GlyphAtlas {
+    struct Glyph {
+        SDL_Rect src = {0, 0, 0, 0};
+        int advance = 0;
+        bool loaded = false;
+    };
+    TTF_Font * font = NULL;
+    int width = 0;
     SDL_Renderer * ren;
+    RenderStats * stats = NULL;
+    unsigned int * generation = NULL; // bumped when the texture is replaced
+    SDL_Surface * surface = NULL; // CPU copy of the texture, used when the atlas has to grow
+    SDL_Texture * texture = NULL;
+    Glyph glyphs[256];
+    int penX = 0, penY = 0, rowHeight = 0;
+
+    GlyphAtlas(SDL_Renderer * r, int size);
+    ~GlyphAtlas();
+    const Glyph& getGlyph(unsigned char ch);
+private:
+    bool resize(int height);
+};
+
+// Collects the triangles of a frame, and submits them in as few draw calls as possible.
+// A draw call is only issued at the end of the frame, or when the texture changes.
+struct GeometryBatch {
+    SDL_Renderer * ren = NULL;
+    SDL_Texture * texture = NULL;
+    RenderStats * stats = NULL;
+    std::vector<SDL_Vertex> vertices;
+
+    // Returns the vertex buffer to append triangles to, using the specified texture.
+    std::vector<SDL_Vertex>& get(SDL_Texture * tex) {
+        if (tex != texture) {
+            flush();
+            texture = tex;
+        }
+        return vertices;
+    }
+    void flush() {
+        if (vertices.empty()) return;
+        SDL_RenderGeometry(ren, texture, vertices.data(), vertices.size(), NULL, 0);
+        stats->drawCalls.fetch_add(1, std::memory_order_relaxed);
+        stats->vertices.fetch_add(vertices.size(), std::memory_order_relaxed);
+        vertices.clear();
+    }
+    // Flushes and forgets the current texture, which must be done before a texture in use is destroyed.
+    void reset() {
+        flush();
+        texture = NULL;
+    }
+};
+
+// An affine 2D transform from the coordinates of a group to canvas coordinates.
+// Most groups only move their children, which keeps their geometry on whole pixels.
+struct Transform2D {
+    float a = 1, b = 0, c = 0, d = 1; // x' = a*x + c*y + x, y' = b*x + d*y + y
+    float x = 0, y = 0;
+
+    bool isTranslation() const {return a == 1 && b == 0 && c == 0 && d == 1;}
+    SDL_FPoint apply(SDL_FPoint p) const {return {a * p.x + c * p.y + x, b * p.x + d * p.y + y};}
+    // Applies o first, then this transform.
+    Transform2D operator*(const Transform2D& o) const {
+        Transform2D r;
+        r.a = a * o.a + c * o.b; r.b = b * o.a + d * o.b;
+        r.c = a * o.c + c * o.d; r.d = b * o.c + d * o.d;
+        r.x = a * o.x + c * o.y + x; r.y = b * o.x + d * o.y + y;
+        return r;
+    }
+    bool operator==(const Transform2D& o) const {return a == o.a && b == o.b && c == o.c && d == o.d && x == o.x && y == o.y;}
+    // Scales, then rotates clockwise (in degrees), then moves to pos.
+    static Transform2D place(SDL_Point pos, float degrees, SDL_FPoint scale);
+};
+
+struct Vec3 {
+    float x, y, z;
+};
+
+// An affine 3D transform: a 3x3 rotation and scale matrix, followed by a translation in the last column.
+struct Transform3D {
+    float m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    Vec3 apply(Vec3 v) const {
+        return {
+            m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z + m[0][3],
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z + m[1][3],
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z + m[2][3]
+        };
+    }
+    Transform3D operator*(const Transform3D& o) const {
+        Transform3D r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++)
+                r.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] + m[i][2] * o.m[2][j];
+            r.m[i][3] += m[i][3];
+        }
+        return r;
+    }
+    static Transform3D translate(Vec3 v) {
+        Transform3D r;
+        r.m[0][3] = v.x;
+        r.m[1][3] = v.y;
+        r.m[2][3] = v.z;
+        return r;
+    }
+    static Transform3D scale(Vec3 v) {
+        Transform3D r;
+        r.m[0][0] = v.x;
+        r.m[1][1] = v.y;
+        r.m[2][2] = v.z;
+        return r;
+    }
+    // Rotates around the Z axis, then X, then Y, by angles in degrees.
+    static Transform3D rotate(Vec3 degrees);
+};
+
+// The 3D canvas of a frame, projected to window coordinates. SDL can't test depth, so the triangles are
+// drawn back to front instead. Only rebuilt when the 3D canvas or the camera changes; drawing it again
+// (under a changed part of the 2D canvas) just copies the finished vertices.
+struct Scene3D {
+    struct Triangle {
+        SDL_Vertex v[3];
+        SDL_Texture * texture;
+    };
+    struct Order {
+        bool onTop; // not depth tested, so drawn after everything else
+        float depth;
+        uint32_t index;
+        bool operator<(const Order& o) const {return onTop != o.onTop ? o.onTop : depth > o.depth;}
+    };
+    struct Run {
+        SDL_Texture * texture;
+        size_t end; // index after the last vertex using the texture
+    };
+    GlassesRenderer * ren = NULL;
+    Transform3D view; // world to view space: x to the right, y up and z away from the camera
+    float focal = 1.0f;
+    std::vector<Triangle> triangles;
+    std::vector<Order> order;
+    std::vector<SDL_Vertex> vertices;
+    std::vector<Run> runs;
+
+    static constexpr float NEAR_Z = 0.05f, FAR_Z = 1024.0f;
+
+    // Starts a new scene seen from the origin; yaw and pitch follow Minecraft (yaw 0 faces +Z, positive pitch looks down).
+    void begin(GlassesRenderer * r, float yaw, float pitch, float fov);
+    // Checks a bounding sphere in view space against the view frustum.
+    bool visible(Vec3 center, float radius) const;
+    // Adds a triangle in view space, clipped against the near plane.
+    void addTriangle(const Vec3 (&p)[3], const SDL_FPoint (&uv)[3], SDL_Color color, SDL_Texture * texture, bool onTop);
+    // Adds a line in view space, as a quad of a thickness in pixels.
+    void addLine(Vec3 a, Vec3 b, float thickness, SDL_Color color, bool onTop);
+    // Sorts the triangles, and groups them by texture.
+    void finish();
+    void draw(GeometryBatch& batch) const;
+private:
+    SDL_FPoint project(Vec3 p) const;
+};
+
+// A small pool of threads that run the iterations of a loop in parallel.
+// The iterations are split into ranges which are dealt out to one queue per thread; a thread that runs out
+// of work steals ranges from the back of the other queues, so uneven work (like one huge polygon) balances out.
+class WorkerPool {
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::pair<size_t, size_t>> ranges;
+    };
+    std::vector<std::thread> threads;
+    std::vector<Queue> queues; // one per worker, plus one for the thread calling run()
+    std::mutex lock;
+    std::mutex runLock; // the render thread and captures on computer threads share the pool, one loop at a time
+    std::condition_variable startNotify, doneNotify;
+    const std::function<void(size_t)> * job = NULL;
+    unsigned generation = 0;
+    size_t active = 0;
+    bool running = true;
+
+    bool next(size_t self, std::pair<size_t, size_t>& range) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& q = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> qlock(q.lock);
+            if (q.ranges.empty()) continue;
+            if (i == 0) {
+                range = q.ranges.front();
+                q.ranges.pop_front();
+            } else {
+                range = q.ranges.back();
+                q.ranges.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        std::pair<size_t, size_t> range;
+        while (next(self, range))
+            for (size_t i = range.first; i < range.second; i++) (*job)(i);
+    }
+
+    void worker(size_t self) {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> ulock(lock);
+        while (true) {
+            startNotify.wait(ulock, [this, &seen]()->bool {return !running || generation != seen;});
+            if (!running) return;
+            seen = generation;
+            ulock.unlock();
+            work(self);
+            ulock.lock();
+            if (--active == 0) doneNotify.notify_all();
+        }
+    }
+public:
+    WorkerPool(size_t count): queues(count + 1) {
+        for (size_t i = 1; i <= count; i++) threads.push_back(std::thread(&WorkerPool::worker, this, i));
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> glock(lock);
+            running = false;
+        }
+        startNotify.notify_all();
+        for (std::thread& t : threads) t.join();
+    }
+    // Calls fn for every index below count, and returns once all calls are done.
+    // Callers on other threads wait for the running loop to finish; fn must not call run itself.
+    void run(size_t count, const std::function<void(size_t)>& fn) {
+        if (threads.empty() || count < 2) {
+            for (size_t i = 0; i < count; i++) fn(i);
+            return;
+        }
+        std::lock_guard<std::mutex> rlock(runLock);
+        // A few ranges per thread leaves something to steal.
+        const size_t grain = std::max((size_t)1, count / (queues.size() * 4));
+        for (size_t i = 0, q = 0; i < count; i += grain, q = (q + 1) % queues.size()) {
+            std::lock_guard<std::mutex> qlock(queues[q].lock);
+            queues[q].ranges.push_back(std::make_pair(i, std::min(i + grain, count)));
+        }
+        {
+            std::lock_guard<std::mutex> glock(lock);
+            job = &fn;
+            active = threads.size();
+            generation++;
+        }
+        startNotify.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> ulock(lock);
+        doneNotify.wait(ulock, [this]()->bool {return active == 0;});
+        job = NULL;
+    }
+};
+
+// Memory for scene objects. Every object size has its own pool, which hands out objects from large slabs
+// and keeps freed ones on a free list for the next object of that size. Since each type of object has its own
+// size, scripts that create and remove many objects reuse the same memory instead of fragmenting the heap.
+// Slabs are only freed when the plugin is unloaded.
+class ObjectPool {
+    struct FreeObject {
+        FreeObject * next;
+    };
+    static constexpr size_t SLAB_SIZE = 16384;
+    std::mutex lock; // objects may be created and deleted on different computer threads
+    FreeObject * freeList = NULL;
+    std::vector<void*> slabs;
+
+    void grow(size_t size) {
+        char * slab = (char*)::operator new(SLAB_SIZE);
+        slabs.push_back(slab);
+        for (size_t off = 0; off + size <= SLAB_SIZE; off += size) {
+            FreeObject * obj = (FreeObject*)(slab + off);
+            obj->next = freeList;
+            freeList = obj;
+        }
+    }
+public:
+    static constexpr size_t GRANULARITY = alignof(std::max_align_t);
+    static constexpr size_t MAX_SIZE = 512; // larger objects come from the heap
+
+    ~ObjectPool() {
+        for (void* slab : slabs) ::operator delete(slab);
+    }
+
+    static ObjectPool& forSize(size_t size) {
+        static ObjectPool pools[MAX_SIZE / GRANULARITY];
+        return pools[(size - 1) / GRANULARITY];
+    }
+
+    static void* allocate(size_t size) {
+        ObjectPool& pool = forSize(size);
+        std::lock_guard<std::mutex> guard(pool.lock);
+        if (pool.freeList == NULL) pool.grow(((size - 1) / GRANULARITY + 1) * GRANULARITY);
+        FreeObject * obj = pool.freeList;
+        pool.freeList = obj->next;
+        return obj;
+    }
+
+    static void free(void* ptr, size_t size) {
+        ObjectPool& pool = forSize(size);
+        std::lock_guard<std::mutex> guard(pool.lock);
+        FreeObject * obj = (FreeObject*)ptr;
+        obj->next = pool.freeList;
+        pool.freeList = obj;
+    }
+};
+
+struct GlassesRenderer {
+    SDL_Window * win = NULL;
+    SDL_Renderer * ren = NULL;
+    SDL_Surface * surface = NULL; // what a headless renderer draws to, instead of a window
     SDL_GLContext glCtx;
     objects::object2d::Frame2D * canvas2d;
+    objects::object3d::Canvas3D * canvas3d;
     std::mutex renderlock;
     Computer * computer;
     std::string side;
-
-    GlassesRenderer();
+    HandleTable * handles; // belongs to the computer, so handles stay valid after the renderer is gone
+    std::map<int, GlyphAtlas*> fonts;
+    GeometryBatch batch;
+    SDL_Texture * target = NULL; // persistent copy of the canvas, only damaged areas are redrawn
+    bool targetUnsupported = false; // set when the renderer couldn't create target textures, so every frame is drawn in full
+    std::vector<std::pair<objects::BaseObject*, Transform2D>> dirtyObjects; // objects to rebuild this frame, with their transforms
+    unsigned int glyphGeneration = 0; // bumped when a font atlas grows, so cached groups check their text again
+    std::atomic<int> maxFPS; // 0 = the computer's clock speed
+    std::chrono::steady_clock::time_point nextFrame; // earliest time the next frame may be rendered
+    std::atomic<bool> presentPending;
+    int users = 0; // render passes and presents using the renderer outside of renderTargetsLock, guarded by it
+    RenderStats stats;
+    Scene3D scene3d; // the projected 3D canvas, drawn under the 2D canvas
+    std::mutex textureLock;
+    std::vector<SDL_Texture*> deadTextures; // textures of removed objects, destroyed by the next frame
+
+    GlassesRenderer(Computer * comp, const char * s, bool headless = false);
     ~GlassesRenderer();
+    bool isDirty() const;
     bool render();
+    void queuePresent();
+    // Reads the current frame as RGBA, rendering any changes first.
+    bool capture(std::vector<Uint8>& pixels);
+    void rebuildGeometry();
+    // Updates the objects of a 2D frame, rebuilds their geometry and then the bounds of their groups.
+    void updateGeometry(objects::object2d::Frame2D * frame);
+    GlyphAtlas * getFont(int size);
+    // Redraws the changed parts of a 2D frame placed in the 3D canvas into its texture, creating the texture if needed.
+    void renderFrame(objects::object2d::Frame2D * frame, SDL_Texture *& texture);
+    // Destroys a texture once the render thread is done with it. Objects can be removed from any thread.
+    void releaseTexture(SDL_Texture * texture);
+private:
+    void drawDamage(objects::object2d::Frame2D * canvas, const std::vector<SDL_Rect>& damage, SDL_Color background, const Scene3D * scene);
 };
 
 constexpr int WIDTH = 512;
 constexpr int HEIGHT = 512 / 16 * 9;
 static std::list<GlassesRenderer*> renderTargets;
 static std::mutex renderTargetsLock;
+static std::condition_variable renderTargetsIdle; // notified when a renderer is no longer in use
 static const PluginFunctions * functions;
 static PluginInfo info("glasses", 4);
-static bool renderRunning = true;
+static std::atomic<bool> renderRunning(true);
 static std::thread renderThread;
+// The render thread sleeps until a canvas changes, or until a throttled renderer may render again.
+static std::mutex renderNotifyLock;
+static std::condition_variable renderNotify;
+static std::atomic<bool> renderPending(false);
+static int defaultMaxFPS = 0;
+static bool defaultHeadless = false;
+static WorkerPool * geometryPool = NULL;
+// Rebuilding geometry on the pool only pays off with enough work, measured in points.
+static constexpr size_t PARALLEL_BUILD_COST = 4096;
+
+static void wakeRenderLoop() {
+    if (renderPending.exchange(true)) return; // already woken up
+    std::lock_guard<std::mutex> lock(renderNotifyLock);
+    renderNotify.notify_all();
+}
 
 static std::vector<std::string> split(const std::string& strToSplit, const char * delims = "\n") {
     std::vector<std::string> retval;
@@ -134,137 +683,971 @@ static SDL_Point luaL_checkpoint(lua_State *L, int arg) {
     return retval;
 }
 
+static Vec3 luaL_checkpoint3d(lua_State *L, int arg) {
+    Vec3 retval;
+    float * coords[3] = {&retval.x, &retval.y, &retval.z};
+    luaL_checktype(L, arg, LUA_TTABLE);
+    for (int i = 0; i < 3; i++) {
+        lua_rawgeti(L, arg, i + 1);
+        const int tt = lua_type(L, -1);
+        if (tt != LUA_TNUMBER) {
+            lua_pop(L, 1);
+            luaL_error(L, "bad %c coordinate for argument #%d (expected number, got %s)", "XYZ"[i], arg, lua_typename(L, tt));
+        }
+        *coords[i] = (float)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    return retval;
+}
+
+// Keeps a malicious addObjects call from overflowing the C stack with nested groups.
+static constexpr int MAX_GROUP_DEPTH = 64;
+
+// Descriptors of addObjects are arrays of the arguments of the add* method, after the type name.
+// Their fields aren't arguments of the call, so errors name the object instead.
+static lua_Integer descInteger(lua_State *L, int d, int n, size_t obj, bool optional = false, lua_Integer def = 0) {
+    lua_rawgeti(L, d, n);
+    if (optional && lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return def;
+    }
+    if (lua_type(L, -1) != LUA_TNUMBER) luaL_error(L, "bad object #%d (expected number for field #%d, got %s)", (int)obj, n, luaL_typename(L, -1));
+    const lua_Integer retval = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return retval;
+}
+
+static double descNumber(lua_State *L, int d, int n, size_t obj, double def) {
+    lua_rawgeti(L, d, n);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return def;
+    }
+    if (lua_type(L, -1) != LUA_TNUMBER) luaL_error(L, "bad object #%d (expected number for field #%d, got %s)", (int)obj, n, luaL_typename(L, -1));
+    const double retval = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return retval;
+}
+
+static SDL_Point descPoint(lua_State *L, int d, int n, size_t obj) {
+    lua_rawgeti(L, d, n);
+    if (!lua_istable(L, -1)) luaL_error(L, "bad object #%d (expected point for field #%d, got %s)", (int)obj, n, luaL_typename(L, -1));
+    const int t = lua_gettop(L);
+    SDL_Point retval;
+    retval.x = descInteger(L, t, 1, obj);
+    retval.y = descInteger(L, t, 2, obj);
+    lua_pop(L, 1);
+    return retval;
+}
+
+static void descPoints(lua_State *L, int d, int n, size_t obj, SceneBatch& batch, ObjectDesc& desc) {
+    lua_rawgeti(L, d, n);
+    if (!lua_istable(L, -1)) luaL_error(L, "bad object #%d (expected table for field #%d, got %s)", (int)obj, n, luaL_typename(L, -1));
+    const int t = lua_gettop(L);
+    desc.first = batch.points.size();
+    lua_rawgeti(L, t, 1);
+    const bool flat = lua_type(L, -1) == LUA_TNUMBER;
+    lua_pop(L, 1);
+    if (flat) {
+        // {x1, y1, x2, y2, ...}
+        const int len = lua_objlen(L, t);
+        if (len % 2) luaL_error(L, "bad object #%d (odd number of coordinates in field #%d)", (int)obj, n);
+        for (int i = 1; i < len; i += 2) batch.points.push_back({(int)descInteger(L, t, i, obj), (int)descInteger(L, t, i + 1, obj)});
+    } else {
+        for (int i = 1; ; i++) {
+            lua_rawgeti(L, t, i);
+            const bool end = lua_isnil(L, -1);
+            lua_pop(L, 1);
+            if (end) break;
+            batch.points.push_back(descPoint(L, t, i, obj));
+        }
+    }
+    desc.count = batch.points.size() - desc.first;
+    lua_pop(L, 1);
+}
+
+// Reads an array of descriptors into the batch, and returns how many it had.
+static size_t readObjectTable(lua_State *L, int idx, SceneBatch& batch, int depth = 0) {
+    if (depth > MAX_GROUP_DEPTH) luaL_error(L, "bad object #%d (groups are nested too deeply)", (int)batch.objects.size());
+    luaL_checkstack(L, 8, "groups are nested too deeply");
+    size_t count = 0;
+    for (int i = 1; ; i++, count++) {
+        lua_rawgeti(L, idx, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return count;
+        }
+        const int d = lua_gettop(L);
+        const size_t obj = batch.objects.size() + 1;
+        if (!lua_istable(L, d)) luaL_error(L, "bad object #%d (expected table, got %s)", (int)obj, luaL_typename(L, d));
+        lua_rawgeti(L, d, 1);
+        const char * name = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : "";
+        ObjectDesc desc = {};
+        desc.color = 0xFFFFFFFF;
+        desc.size = 1.0;
+        if (strcmp(name, "dot") == 0) {
+            desc.type = 'd';
+            desc.points[0] = descPoint(L, d, 2, obj);
+            desc.color = descInteger(L, d, 3, obj, true, desc.color);
+            desc.size = descInteger(L, d, 4, obj, true, 1);
+        } else if (strcmp(name, "group") == 0) {
+            desc.type = 'g';
+            desc.points[0] = descPoint(L, d, 2, obj);
+        } else if (strcmp(name, "line") == 0) {
+            desc.type = 'l';
+            desc.points[0] = descPoint(L, d, 2, obj);
+            desc.points[1] = descPoint(L, d, 3, obj);
+            desc.color = descInteger(L, d, 4, obj, true, desc.color);
+            desc.size = descNumber(L, d, 5, obj, 1.0);
+        } else if (strcmp(name, "lines") == 0) {
+            desc.type = 'L';
+            descPoints(L, d, 2, obj, batch, desc);
+            desc.color = descInteger(L, d, 3, obj, true, desc.color);
+            desc.size = descNumber(L, d, 4, obj, 1.0);
+        } else if (strcmp(name, "polygon") == 0) {
+            desc.type = 'p';
+            descPoints(L, d, 2, obj, batch, desc);
+            desc.color = descInteger(L, d, 3, obj, true, desc.color);
+        } else if (strcmp(name, "rectangle") == 0) {
+            desc.type = 'r';
+            desc.points[0] = {(int)descInteger(L, d, 2, obj), (int)descInteger(L, d, 3, obj)};
+            desc.points[1] = {(int)descInteger(L, d, 4, obj), (int)descInteger(L, d, 5, obj)};
+            desc.color = descInteger(L, d, 6, obj, true, desc.color);
+        } else if (strcmp(name, "text") == 0) {
+            desc.type = 'T';
+            desc.points[0] = descPoint(L, d, 2, obj);
+            lua_rawgeti(L, d, 3);
+            if (!lua_isstring(L, -1)) luaL_error(L, "bad object #%d (expected string for field #3, got %s)", (int)obj, luaL_typename(L, -1));
+            size_t len;
+            const char * str = lua_tolstring(L, -1, &len);
+            desc.first = batch.text.size();
+            desc.count = len;
+            batch.text.append(str, len);
+            lua_pop(L, 1);
+            desc.color = descInteger(L, d, 4, obj, true, desc.color);
+            desc.size = descNumber(L, d, 5, obj, 1.0);
+        } else if (strcmp(name, "triangle") == 0) {
+            desc.type = 't';
+            for (int j = 0; j < 3; j++) desc.points[j] = descPoint(L, d, j + 2, obj);
+            desc.color = descInteger(L, d, 5, obj, true, desc.color);
+        } else luaL_error(L, "bad object #%d (unknown type '%s')", (int)obj, name);
+        const size_t pos = batch.objects.size();
+        batch.objects.push_back(desc);
+        if (desc.type == 'g') {
+            lua_rawgeti(L, d, 3);
+            if (!lua_istable(L, -1)) luaL_error(L, "bad object #%d (expected table for field #3, got %s)", (int)obj, luaL_typename(L, -1));
+            batch.objects[pos].count = readObjectTable(L, lua_gettop(L), batch, depth + 1);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+    }
+}
+
+// Reads the little-endian fields of a packed addObjects string.
+struct PackedReader {
+    lua_State *L;
+    const unsigned char * pos;
+    const unsigned char * end;
+    size_t obj;
+
+    void need(size_t n) {
+        if ((size_t)(end - pos) < n) luaL_error(L, "bad object #%d (data ends early)", (int)obj);
+    }
+    unsigned u8() {
+        need(1);
+        return *pos++;
+    }
+    unsigned u16() {
+        need(2);
+        const unsigned retval = pos[0] | pos[1] << 8;
+        pos += 2;
+        return retval;
+    }
+    int i16() {
+        return (Sint16)u16();
+    }
+    unsigned int u32() {
+        need(4);
+        const unsigned int retval = pos[0] | pos[1] << 8 | pos[2] << 16 | (unsigned int)pos[3] << 24;
+        pos += 4;
+        return retval;
+    }
+    SDL_Point point() {
+        const int x = i16();
+        return {x, i16()};
+    }
+};
+
+// Reads count objects from a packed string, or all of them if toEnd is set; returns how many were read.
+static size_t readPackedObjects(PackedReader& in, SceneBatch& batch, size_t count, bool toEnd, int depth = 0) {
+    if (depth > MAX_GROUP_DEPTH) luaL_error(in.L, "bad object #%d (groups are nested too deeply)", (int)in.obj);
+    size_t n = 0;
+    for (; toEnd ? in.pos < in.end : n < count; n++) {
+        in.obj = batch.objects.size() + 1;
+        ObjectDesc desc = {};
+        desc.type = in.u8();
+        switch (desc.type) {
+        case 'd':
+            desc.points[0] = in.point();
+            desc.color = in.u32();
+            desc.size = in.u8();
+            break;
+        case 'g':
+            desc.points[0] = in.point();
+            desc.count = in.u16();
+            break;
+        case 'l':
+            desc.points[0] = in.point();
+            desc.points[1] = in.point();
+            desc.color = in.u32();
+            desc.size = in.u8();
+            break;
+        case 'L': case 'p':
+            desc.count = in.u16();
+            in.need(desc.count * 4);
+            desc.first = batch.points.size();
+            for (size_t i = 0; i < desc.count; i++) batch.points.push_back(in.point());
+            desc.color = in.u32();
+            if (desc.type == 'L') desc.size = in.u8();
+            break;
+        case 'r':
+            desc.points[0] = in.point();
+            desc.points[1] = in.point();
+            desc.color = in.u32();
+            break;
+        case 'T':
+            desc.points[0] = in.point();
+            desc.color = in.u32();
+            desc.size = in.u8();
+            desc.count = in.u16();
+            in.need(desc.count);
+            desc.first = batch.text.size();
+            batch.text.append((const char*)in.pos, desc.count);
+            in.pos += desc.count;
+            break;
+        case 't':
+            for (int j = 0; j < 3; j++) desc.points[j] = in.point();
+            desc.color = in.u32();
+            break;
+        default:
+            luaL_error(in.L, "bad object #%d (unknown type '%c')", (int)in.obj, desc.type);
+        }
+        const size_t pos = batch.objects.size();
+        batch.objects.push_back(desc);
+        if (desc.type == 'g') batch.objects[pos].count = readPackedObjects(in, batch, desc.count, false, depth + 1);
+    }
+    return n;
+}
+
+// Reads a list of points: an array of {x, y} tables, a flat array of coordinates ({x1, y1, x2, y2, ...}),
+// or a string of signed 16-bit little-endian coordinate pairs.
+static void luaL_checkpoints(lua_State *L, int arg, std::vector<SDL_Point>& points) {
+    points.clear();
+    if (lua_type(L, arg) == LUA_TSTRING) {
+        size_t len;
+        const unsigned char * data = (const unsigned char*)lua_tolstring(L, arg, &len);
+        if (len % 4) luaL_argerror(L, arg, "packed points must be 4 bytes each");
+        points.resize(len / 4);
+        for (SDL_Point& p : points) {
+            p.x = (Sint16)(data[0] | data[1] << 8);
+            p.y = (Sint16)(data[2] | data[3] << 8);
+            data += 4;
+        }
+        return;
+    }
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_rawgeti(L, arg, 1);
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        lua_pop(L, 1);
+        const int n = lua_objlen(L, arg);
+        if (n % 2) luaL_argerror(L, arg, "odd number of coordinates");
+        points.resize(n / 2);
+        for (int i = 0; i < n; i++) {
+            lua_rawgeti(L, arg, i + 1);
+            if (lua_type(L, -1) != LUA_TNUMBER) luaL_error(L, "bad coordinate #%d for argument #%d (expected number, got %s)", i + 1, arg, luaL_typename(L, -1));
+            if (i % 2) points[i/2].y = lua_tointeger(L, -1);
+            else points[i/2].x = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+    for (int i = 1; !lua_isnil(L, -1); i++) {
+        points.push_back(luaL_checkpoint(L, -1));
+        lua_pop(L, 1);
+        lua_rawgeti(L, arg, i+1);
+    }
+    lua_pop(L, 1);
+}
+
+// Point lists read from Lua; kept between calls so animating large polygons doesn't allocate.
+static thread_local std::vector<SDL_Point> pointBuffer;
+
+static Uint32 crc32(Uint32 crc, const Uint8 * data, size_t len) {
+    // Static initialization is thread-safe, so captures on several computers can't see a half-built table.
+    static const struct Table {
+        Uint32 entries[256];
+        Table() {
+            for (Uint32 i = 0; i < 256; i++) {
+                Uint32 c = i;
+                for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                entries[i] = c;
+            }
+        }
+    } table;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putBE32(std::string& out, Uint32 v) {
+    out += (char)(v >> 24);
+    out += (char)(v >> 16);
+    out += (char)(v >> 8);
+    out += (char)v;
+}
+
+static void pngChunk(std::string& out, const char * type, const std::string& data) {
+    putBE32(out, data.size());
+    const size_t start = out.size();
+    out.append(type, 4);
+    out += data;
+    putBE32(out, crc32(0, (const Uint8*)out.data() + start, out.size() - start));
+}
+
+// Encodes RGBA pixels as a PNG file. The image data goes into uncompressed deflate blocks,
+// which makes the files larger, but doesn't need zlib.
+static std::string encodePNG(const Uint8 * rgba, int width, int height) {
+    std::string out("\x89PNG\r\n\x1a\n", 8), header;
+    putBE32(header, width);
+    putBE32(header, height);
+    header.append("\x08\x06\x00\x00\x00", 5); // 8-bit RGBA, no interlacing
+    pngChunk(out, "IHDR", header);
+    std::string raw;
+    raw.reserve((width * 4 + 1) * height);
+    for (int y = 0; y < height; y++) {
+        raw += '\0'; // no filter
+        raw.append((const char*)rgba + y * width * 4, width * 4);
+    }
+    std::string zlib("\x78\x01", 2);
+    Uint32 a = 1, b = 0;
+    for (size_t pos = 0; pos < raw.size();) {
+        const size_t len = std::min(raw.size() - pos, (size_t)65535);
+        zlib += (char)(pos + len == raw.size());
+        zlib += (char)(len & 0xFF);
+        zlib += (char)(len >> 8);
+        zlib += (char)(~len & 0xFF);
+        zlib += (char)((~len >> 8) & 0xFF);
+        zlib.append(raw, pos, len);
+        for (size_t i = pos; i < pos + len; i++) {
+            a = (a + (Uint8)raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        pos += len;
+    }
+    putBE32(zlib, (b << 16) | a);
+    pngChunk(out, "IDAT", zlib);
+    pngChunk(out, "IEND", "");
+    return out;
+}
+
+static bool rectEmpty(const SDL_Rect& r) {
+    return r.w <= 0 || r.h <= 0;
+}
+
+static SDL_Rect unionRect(const SDL_Rect& a, const SDL_Rect& b) {
+    if (rectEmpty(a)) return b;
+    if (rectEmpty(b)) return a;
+    const int x = std::min(a.x, b.x), y = std::min(a.y, b.y);
+    return {x, y, std::max(a.x + a.w, b.x + b.w) - x, std::max(a.y + a.h, b.y + b.h) - y};
+}
+
+static bool intersects(const SDL_Rect& a, const SDL_Rect& b) {
+    return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+static SDL_Rect vertexBounds(const std::vector<SDL_Vertex>& vertices) {
+    if (vertices.empty()) return {0, 0, 0, 0};
+    float x1 = vertices[0].position.x, y1 = vertices[0].position.y, x2 = x1, y2 = y1;
+    for (const SDL_Vertex& v : vertices) {
+        if (v.position.x < x1) x1 = v.position.x;
+        if (v.position.x > x2) x2 = v.position.x;
+        if (v.position.y < y1) y1 = v.position.y;
+        if (v.position.y > y2) y2 = v.position.y;
+    }
+    const int ix = floor(x1), iy = floor(y1);
+    return {ix, iy, (int)ceil(x2) - ix, (int)ceil(y2) - iy};
+}
+
+static void pushTriangle(std::vector<SDL_Vertex>& vertices, SDL_FPoint a, SDL_FPoint b, SDL_FPoint c, SDL_Color color) {
+    vertices.push_back({a, color, {0, 0}});
+    vertices.push_back({b, color, {0, 0}});
+    vertices.push_back({c, color, {0, 0}});
+}
+
+static void pushQuad(std::vector<SDL_Vertex>& vertices, SDL_FPoint a, SDL_FPoint b, SDL_FPoint c, SDL_FPoint d, SDL_Color color) {
+    pushTriangle(vertices, a, b, c, color);
+    pushTriangle(vertices, a, c, d, color);
+}
+
+// Adds a rectangle covering the pixels from (x1, y1) up to but not including (x2, y2).
+static void pushRect(std::vector<SDL_Vertex>& vertices, float x1, float y1, float x2, float y2, SDL_Color color) {
+    pushQuad(vertices, {x1, y1}, {x2, y1}, {x2, y2}, {x1, y2}, color);
+}
+
+static void pushDot(std::vector<SDL_Vertex>& vertices, SDL_Point pos, double scale, Uint32 color) {
+    pushRect(vertices, (int)(pos.x - scale), (int)(pos.y - scale), (int)(pos.x + scale) + 1, (int)(pos.y + scale) + 1, {rgba(color)});
+}
+
+// Outline, one pixel wide
+static void pushRectOutline(std::vector<SDL_Vertex>& vertices, SDL_Point pos, SDL_Point size, Uint32 color) {
+    if (size.x <= 0 || size.y <= 0) return;
+    const float x1 = pos.x, y1 = pos.y, x2 = x1 + size.x, y2 = y1 + size.y;
+    const SDL_Color c = {rgba(color)};
+    pushRect(vertices, x1, y1, x2, y1 + 1, c);
+    if (size.y > 1) pushRect(vertices, x1, y2 - 1, x2, y2, c);
+    if (size.y > 2) {
+        pushRect(vertices, x1, y1 + 1, x1 + 1, y2 - 1, c);
+        if (size.x > 1) pushRect(vertices, x2 - 1, y1 + 1, x2, y2 - 1, c);
+    }
+}
+
 // Code borrowed from SDL2_gfx
-static int thickLineColor_ren(SDL_Renderer *renderer, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Uint8 width, Uint32 color)
+static void pushThickLine(std::vector<SDL_Vertex>& vertices, Sint16 x1, Sint16 y1, Sint16 x2, Sint16 y2, Uint8 width, Uint32 color)
 {
     int wh;
     double dx, dy, dx1, dy1, dx2, dy2;
     double l, wl2, nx, ny, ang, adj;
-    SDL_Vertex vertices[6];
-
-    if (renderer == NULL) {
-        return -1;
-    }
 
     if (width < 1) {
-        return -1;
+        return;
     }
 
     /* Special case: thick "point" */
     if ((x1 == x2) && (y1 == y2)) {
         wh = width / 2;
-        return boxRGBA(renderer, x1 - wh, y1 - wh, x2 + width, y2 + width, rgba(color));		
-    }
-
-    /* Special case: width == 1 */
-    if (width == 1) {
-        return lineRGBA(renderer, x1, y1, x2, y2, rgba(color));		
+        pushRect(vertices, x1 - wh, y1 - wh, x2 + width + 1, y2 + width + 1, {rgba(color)});
+        return;
     }
 
     /* Calculate offsets for sides */
     dx = (double)(x2 - x1);
     dy = (double)(y2 - y1);
     l = SDL_sqrt(dx*dx + dy*dy);
-    ang = SDL_atan2(dx, dy);
-    adj = 0.1 + 0.9 * SDL_fabs(SDL_cos(2.0 * ang));
-    wl2 = ((double)width - adj)/(2.0 * l);
+    if (width == 1) {
+        /* Special case: width == 1, a one pixel wide quad through the pixel centers */
+        wl2 = 0.5 / l;
+        dx1 = (double)x1 + 0.5 - dx * wl2;
+        dy1 = (double)y1 + 0.5 - dy * wl2;
+        dx2 = (double)x2 + 0.5 + dx * wl2;
+        dy2 = (double)y2 + 0.5 + dy * wl2;
+    } else {
+        ang = SDL_atan2(dx, dy);
+        adj = 0.1 + 0.9 * SDL_fabs(SDL_cos(2.0 * ang));
+        wl2 = ((double)width - adj)/(2.0 * l);
+        dx1 = (double)x1;
+        dy1 = (double)y1;
+        dx2 = (double)x2;
+        dy2 = (double)y2;
+    }
     nx = dx * wl2;
     ny = dy * wl2;
 
     /* Build polygon */
-    dx1 = (double)x1;
-    dy1 = (double)y1;
-    dx2 = (double)x2;
-    dy2 = (double)y2;
-    vertices[0].position.x = (dx1 + ny);
-    vertices[1].position.x = (dx1 - ny);
-    vertices[2].position.x = (dx2 - ny);
-    vertices[3].position.x = (dx2 + ny);
-    vertices[4].position.x = (dx1 + ny);
-    vertices[5].position.x = (dx2 - ny);
-    vertices[0].position.y = (dy1 - nx);
-    vertices[1].position.y = (dy1 + nx);
-    vertices[2].position.y = (dy2 + nx);
-    vertices[3].position.y = (dy2 - nx);
-    vertices[4].position.y = (dy1 - nx);
-    vertices[5].position.y = (dy2 + nx);
-    for (wh = 0; wh < 6; wh++) {
-        vertices[wh].color = {rgba(color)};
-        vertices[wh].tex_coord = {0, 0};
-    }
-
-    /* Draw polygon */
-    return SDL_RenderGeometry(renderer, NULL, vertices, 6, NULL, 0);
-}
-
-static void* savePointer(lua_State *L, void* ptr) {
-    pointerlist_t * pointerlist = (pointerlist_t*)get_comp(L)->userdata[POINTERLIST_INDEX];
-    while (pointerlist->next) {
-        pointerlist = pointerlist->next;
-        if (pointerlist->ptr == ptr) return pointerlist;
-    }
-    pointerlist->next = new pointerlist_t;
-    pointerlist->next->ptr = ptr;
-    return pointerlist->next;
+    pushQuad(vertices,
+        {(float)(dx1 + ny), (float)(dy1 - nx)},
+        {(float)(dx1 - ny), (float)(dy1 + nx)},
+        {(float)(dx2 - ny), (float)(dy2 + nx)},
+        {(float)(dx2 + ny), (float)(dy2 - nx)},
+        {rgba(color)});
 }
 
-template<typename T>
-static T* getUpvalue(lua_State *L) {
-    T *ptr = static_cast<T*>(((pointerlist_t*)lua_touserdata(L, lua_upvalueindex(1)))->ptr); \
-    if (ptr == NULL) luaL_error(L, "object does not exist"); \
-    return ptr;
+GlyphAtlas::GlyphAtlas(SDL_Renderer * r, int size): ren(r) {
+    SDL_RWops * rw = SDL_RWFromConstMem(font_ttf, font_ttf_len);
+    font = TTF_OpenFontRW(rw, true, size);
+    if (font == NULL) return;
+    // Room for a row of 16 glyphs; more rows are added as needed.
+    width = std::max(256, TTF_FontHeight(font) * 16);
+    resize(TTF_FontHeight(font) * 4);
 }
 
-// This imitates the structure of Plethora's objects.
-namespace objects {
+GlyphAtlas::~GlyphAtlas() {
+    if (texture) SDL_DestroyTexture(texture);
+    if (surface) SDL_FreeSurface(surface);
+    if (font) TTF_CloseFont(font);
+}
 
-    // Interfaces
+bool GlyphAtlas::resize(int height) {
+    SDL_Surface * surf = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+    if (surf == NULL) return false;
+    SDL_FillRect(surf, NULL, 0);
+    if (surface) {
+        // Glyphs keep their coordinates, so layouts made before growing are still valid.
+        SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(surface, NULL, surf, NULL);
+        SDL_FreeSurface(surface);
+    }
+    surface = surf;
+    if (generation) (*generation)++;
+    if (texture) SDL_DestroyTexture(texture);
+    texture = SDL_CreateTextureFromSurface(ren, surface);
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    return texture != NULL;
+}
 
-    struct ObjectGroup;
+const GlyphAtlas::Glyph& GlyphAtlas::getGlyph(unsigned char ch) {
+    Glyph& glyph = glyphs[ch];
+    if (glyph.loaded || font == NULL) return glyph;
+    glyph.loaded = true;
+    int minx, maxx, miny, maxy;
+    if (TTF_GlyphMetrics(font, ch, &minx, &maxx, &miny, &maxy, &glyph.advance)) return glyph;
+    SDL_Surface * s = TTF_RenderGlyph_Solid(font, ch, {0xFF, 0xFF, 0xFF, 0xFF});
+    if (s == NULL) return glyph;
+    SDL_Surface * conv = SDL_ConvertSurfaceFormat(s, SDL_PIXELFORMAT_RGBA32, 0);
+    SDL_FreeSurface(s);
+    if (conv == NULL) return glyph;
+    if (stats) stats->glyphs.fetch_add(1, std::memory_order_relaxed);
+    if (penX + conv->w > width) {
+        penX = 0;
+        penY += rowHeight;
+        rowHeight = 0;
+    }
+    if (conv->w > width || (penY + conv->h > surface->h && !resize(std::max(surface->h * 2, penY + conv->h)))) {
+        SDL_FreeSurface(conv);
+        return glyph;
+    }
+    glyph.src = {penX, penY, conv->w, conv->h};
+    SDL_SetSurfaceBlendMode(conv, SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(conv, NULL, surface, &glyph.src);
+    SDL_FreeSurface(conv);
+    SDL_UpdateTexture(texture, &glyph.src, (Uint8*)surface->pixels + glyph.src.y * surface->pitch + glyph.src.x * 4, surface->pitch);
+    penX += glyph.src.w;
+    if (glyph.src.h > rowHeight) rowHeight = glyph.src.h;
+    return glyph;
+}
 
-    class BaseObject {
-        std::unordered_set<Computer*> accessors;
-        LuaVoidMethod(BaseObject, remove)
-    protected:
-        ObjectGroup * parent;
-    public:
-        BaseObject(ObjectGroup * p): parent(p) {}
-        virtual ~BaseObject() {
-            for (Computer * comp : accessors) {
-                pointerlist_t * list = (pointerlist_t*)comp->userdata[POINTERLIST_INDEX];
-                while (list->next) {
-                    list = list->next;
-                    if (list->ptr == this) list->ptr = NULL;
-                }
-            }
+// Checks whether a polygon is convex, in which case it can be triangulated as a fan.
+// Besides every corner turning the same way, the edges must not wind around more than once (like a star).
+static bool isConvex(const std::vector<SDL_Point>& points) {
+    const size_t n = points.size();
+    int turn = 0, xFlips = 0, yFlips = 0, lastDx = 0, lastDy = 0;
+    for (size_t i = 0; i < n; i++) {
+        const SDL_Point& a = points[i], &b = points[(i + 1) % n], &c = points[(i + 2) % n];
+        const long long cross = (long long)(b.x - a.x) * (c.y - b.y) - (long long)(b.y - a.y) * (c.x - b.x);
+        if (cross) {
+            const int t = cross > 0 ? 1 : -1;
+            if (turn && t != turn) return false;
+            turn = t;
         }
-        virtual void remove();
-        virtual void draw(GlassesRenderer * ren, SDL_Point transform) = 0;
-        virtual void setDirty();
+        const int dx = (b.x > a.x) - (b.x < a.x), dy = (b.y > a.y) - (b.y < a.y);
+        if (dx) {
+            if (lastDx && dx != lastDx) xFlips++;
+            lastDx = dx;
+        }
+        if (dy) {
+            if (lastDy && dy != lastDy) yFlips++;
+            lastDy = dy;
+        }
+    }
+    return xFlips <= 2 && yFlips <= 2;
+}
 
-        template<class T>
-        void toLua(lua_State *L, void* ptr) {
-            accessors.insert(get_comp(L));
-            lua_newtable(L);
-            addLuaMethod(remove);
+// Polygons with more points than this are triangulated with the O(n log n) monotone algorithm instead of O(n^2) ear clipping.
+static constexpr size_t MONO_THRESHOLD = 32;
+
+// Triangulates a simple polygon into a flat list of triangle corners.
+static void triangulate(const std::vector<SDL_Point>& points, std::vector<SDL_FPoint>& out) {
+    out.clear();
+    if (points.size() < 3) return;
+    if (isConvex(points)) {
+        out.reserve((points.size() - 2) * 3);
+        const SDL_FPoint first = {(float)points[0].x, (float)points[0].y};
+        for (size_t i = 1; i + 1 < points.size(); i++) {
+            out.push_back(first);
+            out.push_back({(float)points[i].x, (float)points[i].y});
+            out.push_back({(float)points[i+1].x, (float)points[i+1].y});
         }
-    };
+        return;
+    }
+    static thread_local TriangulationArena arena;
+    // Declared first, so the arena is only reset after the polygons are gone.
+    ArenaScope scope(arena);
+    TPPLPartition part;
+    TPPLPoly poly;
+    TPPLPolyList tris;
+    poly.Init(points.size());
+    for (size_t i = 0; i < points.size(); i++) poly[i] = {(tppl_float)points[i].x, (tppl_float)points[i].y};
+    poly.SetOrientation(TPPL_ORIENTATION_CCW);
+    if (points.size() <= MONO_THRESHOLD || !part.Triangulate_MONO(&poly, &tris)) {
+        tris.clear();
+        if (!part.Triangulate_EC(&poly, &tris)) return;
+    }
+    out.reserve(tris.size() * 3);
+    for (TPPLPoly& tri : tris)
+        for (int i = 0; i < 3; i++) out.push_back({(float)tri[i].x, (float)tri[i].y});
+}
 
-    struct Colorable {
-        static const unsigned int DEFAULT_COLOR = 0xFFFFFFFF;
-        virtual int getAlpha() const = 0;
-        virtual unsigned int getColor() const = 0;
-        virtual void setAlpha(int alpha) = 0;
-        virtual void setColor(unsigned int rgb) = 0;
-        virtual void setColor(int r, int g, int b, int a = 255) = 0;
+static constexpr float DEGREES = 3.14159265f / 180.0f;
+
+Transform3D Transform3D::rotate(Vec3 degrees) {
+    const float cx = cosf(degrees.x * DEGREES), sx = sinf(degrees.x * DEGREES);
+    const float cy = cosf(degrees.y * DEGREES), sy = sinf(degrees.y * DEGREES);
+    const float cz = cosf(degrees.z * DEGREES), sz = sinf(degrees.z * DEGREES);
+    Transform3D x, y, z;
+    x.m[1][1] = cx; x.m[1][2] = -sx; x.m[2][1] = sx; x.m[2][2] = cx;
+    y.m[0][0] = cy; y.m[0][2] = sy; y.m[2][0] = -sy; y.m[2][2] = cy;
+    z.m[0][0] = cz; z.m[0][1] = -sz; z.m[1][0] = sz; z.m[1][1] = cz;
+    return y * x * z;
+}
 
-        template<class T>
-        void toLua(lua_State *L, void* ptr) {
-            addLuaMethod(getAlpha)
-            addLuaMethod(getColor)
-            addLuaMethod(setAlpha)
-            addLuaMethod(setColor)
-        }
+Transform2D Transform2D::place(SDL_Point pos, float degrees, SDL_FPoint scale) {
+    Transform2D r;
+    // Exact for the common unrotated case, so the geometry stays on whole pixels.
+    const float cs = degrees == 0.0f ? 1.0f : cosf(degrees * DEGREES), sn = degrees == 0.0f ? 0.0f : sinf(degrees * DEGREES);
+    r.a = cs * scale.x; r.b = sn * scale.x;
+    r.c = -sn * scale.y; r.d = cs * scale.y;
+    r.x = pos.x; r.y = pos.y;
+    return r;
+}
+
+void Scene3D::begin(GlassesRenderer * r, float yaw, float pitch, float fov) {
+    ren = r;
+    const float y = yaw * DEGREES, p = pitch * DEGREES;
+    const Vec3 right = {-cosf(y), 0, -sinf(y)};
+    const Vec3 forward = {-sinf(y) * cosf(p), -sinf(p), cosf(y) * cosf(p)};
+    const Vec3 up = {right.y * forward.z - right.z * forward.y, right.z * forward.x - right.x * forward.z, right.x * forward.y - right.y * forward.x};
+    const Vec3 rows[3] = {right, up, forward};
+    for (int i = 0; i < 3; i++) {
+        view.m[i][0] = rows[i].x;
+        view.m[i][1] = rows[i].y;
+        view.m[i][2] = rows[i].z;
+        view.m[i][3] = 0;
+    }
+    focal = HEIGHT / 2.0f / tanf(fov * DEGREES / 2.0f);
+    triangles.clear();
+    order.clear();
+    vertices.clear();
+    runs.clear();
+}
+
+bool Scene3D::visible(Vec3 center, float radius) const {
+    if (center.z + radius < NEAR_Z || center.z - radius > FAR_Z) return false;
+    // The side planes go through the camera and the edges of the window.
+    const float hw = WIDTH / 2.0f, hh = HEIGHT / 2.0f;
+    return fabsf(center.x) * focal - hw * center.z <= radius * sqrtf(focal * focal + hw * hw) &&
+        fabsf(center.y) * focal - hh * center.z <= radius * sqrtf(focal * focal + hh * hh);
+}
+
+SDL_FPoint Scene3D::project(Vec3 p) const {
+    return {WIDTH / 2.0f + focal * p.x / p.z, HEIGHT / 2.0f - focal * p.y / p.z};
+}
+
+void Scene3D::addTriangle(const Vec3 (&p)[3], const SDL_FPoint (&uv)[3], SDL_Color color, SDL_Texture * texture, bool onTop) {
+    // Cutting off the part behind the near plane leaves three or four corners.
+    Vec3 cp[4];
+    SDL_FPoint cuv[4];
+    int n = 0;
+    for (int i = 0; i < 3; i++) {
+        const int j = (i + 1) % 3;
+        const bool in = p[i].z >= NEAR_Z;
+        if (in) {
+            cp[n] = p[i];
+            cuv[n++] = uv[i];
+        }
+        if (in != (p[j].z >= NEAR_Z)) {
+            const float t = (NEAR_Z - p[i].z) / (p[j].z - p[i].z);
+            cp[n] = {p[i].x + (p[j].x - p[i].x) * t, p[i].y + (p[j].y - p[i].y) * t, NEAR_Z};
+            cuv[n++] = {uv[i].x + (uv[j].x - uv[i].x) * t, uv[i].y + (uv[j].y - uv[i].y) * t};
+        }
+    }
+    if (n < 3) return;
+    SDL_Vertex v[4];
+    float depth = 0;
+    for (int i = 0; i < n; i++) {
+        v[i] = {project(cp[i]), color, cuv[i]};
+        depth += cp[i].z;
+    }
+    depth /= n;
+    for (int i = 1; i + 1 < n; i++) {
+        order.push_back({onTop, depth, (uint32_t)triangles.size()});
+        triangles.push_back({{v[0], v[i], v[i+1]}, texture});
+    }
+}
+
+void Scene3D::addLine(Vec3 a, Vec3 b, float thickness, SDL_Color color, bool onTop) {
+    if (a.z < NEAR_Z && b.z < NEAR_Z) return;
+    if (a.z < NEAR_Z || b.z < NEAR_Z) {
+        if (a.z < NEAR_Z) std::swap(a, b);
+        const float t = (NEAR_Z - a.z) / (b.z - a.z);
+        b = {a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, NEAR_Z};
+    }
+    const SDL_FPoint pa = project(a), pb = project(b);
+    const float dx = pb.x - pa.x, dy = pb.y - pa.y, len = sqrtf(dx * dx + dy * dy);
+    if (len < 0.001f) return;
+    const float nx = -dy / len * thickness / 2.0f, ny = dx / len * thickness / 2.0f, depth = (a.z + b.z) / 2.0f;
+    const SDL_Vertex q[4] = {
+        {{pa.x + nx, pa.y + ny}, color, {0, 0}},
+        {{pb.x + nx, pb.y + ny}, color, {0, 0}},
+        {{pb.x - nx, pb.y - ny}, color, {0, 0}},
+        {{pa.x - nx, pa.y - ny}, color, {0, 0}}
+    };
+    order.push_back({onTop, depth, (uint32_t)triangles.size()});
+    triangles.push_back({{q[0], q[1], q[2]}, NULL});
+    order.push_back({onTop, depth, (uint32_t)triangles.size()});
+    triangles.push_back({{q[0], q[2], q[3]}, NULL});
+}
+
+void Scene3D::finish() {
+    std::sort(order.begin(), order.end());
+    vertices.reserve(order.size() * 3);
+    for (const Order& o : order) {
+        const Triangle& tri = triangles[o.index];
+        if (runs.empty() || runs.back().texture != tri.texture) runs.push_back({tri.texture, 0});
+        vertices.insert(vertices.end(), tri.v, tri.v + 3);
+        runs.back().end = vertices.size();
+    }
+}
+
+void Scene3D::draw(GeometryBatch& batch) const {
+    size_t start = 0;
+    for (const Run& run : runs) {
+        std::vector<SDL_Vertex>& out = batch.get(run.texture);
+        out.insert(out.end(), vertices.begin() + start, vertices.begin() + run.end);
+        start = run.end;
+    }
+}
+
+static HandleTable * getHandleTable(Computer * comp) {
+    if (comp->userdata.find(HANDLETABLE_INDEX) == comp->userdata.end()) {
+        comp->userdata[HANDLETABLE_INDEX] = new HandleTable;
+        comp->userdata_destructors[HANDLETABLE_INDEX] = [](Computer * comp, int idx, void* ptr) {
+            delete (HandleTable*)ptr;
+        };
+    }
+    return (HandleTable*)comp->userdata[HANDLETABLE_INDEX];
+}
+
+template<typename T>
+static T* getUpvalue(lua_State *L) {
+    const LuaHandle * handle = (const LuaHandle*)lua_touserdata(L, lua_upvalueindex(1));
+    objects::BaseObject * ptr = handle->table->get(handle->slot, handle->generation);
+    if (ptr == NULL) luaL_error(L, "object does not exist");
+    return static_cast<T*>(ptr);
+}
+
+// Registry key of the metatable for each type of object.
+template<class T>
+struct LuaType {
+    static char key;
+};
+template<class T> char LuaType<T>::key;
+
+// Methods work both as obj.method(...) and obj:method(...): a first argument that is a handle of the same
+// object is dropped. The upvalues are the handle the method is bound to, the method and the type's metatable.
+static int callMethod(lua_State *L) {
+    if (lua_type(L, 1) == LUA_TUSERDATA && lua_getmetatable(L, 1)) {
+        const LuaHandle * self = (const LuaHandle*)lua_touserdata(L, 1);
+        const LuaHandle * bound = (const LuaHandle*)lua_touserdata(L, lua_upvalueindex(1));
+        const bool same = lua_rawequal(L, -1, lua_upvalueindex(3)) && self->slot == bound->slot && self->generation == bound->generation;
+        lua_pop(L, 1);
+        if (same) lua_remove(L, 1);
+    }
+    return lua_tocfunction(L, lua_upvalueindex(2))(L);
+}
+
+static void retainHandle(const LuaHandle * handle);
+
+// __index of handles. obj.method(...) needs a method bound to the object, and a lookup can't tell it from
+// obj:method(...), so the first lookup of a method on an object binds it. Bound methods are cached per type
+// rather than per handle: the upvalues are the method table, a table of methods bound by slot for each name,
+// and the copy of the handle the methods of each slot are bound to. Handles themselves are only their userdata.
+// The copy is a handle too, so methods a script keeps keep their object.
+static int handleIndex(lua_State *L) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isfunction(L, 3)) return 1;
+    const LuaHandle * handle = (const LuaHandle*)lua_touserdata(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(2));
+    if (lua_isnil(L, 4)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 4);
+        lua_rawset(L, lua_upvalueindex(2));
+    }
+    lua_rawgeti(L, 4, handle->slot);
+    if (!lua_isnil(L, 5)) {
+        // The slot may have been reused by another object since.
+        lua_getupvalue(L, 5, 1);
+        if (((const LuaHandle*)lua_touserdata(L, -1))->generation == handle->generation) {
+            lua_pop(L, 1);
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, lua_upvalueindex(3), handle->slot);
+    if (lua_isnil(L, 5) || ((const LuaHandle*)lua_touserdata(L, 5))->generation != handle->generation) {
+        lua_pop(L, 1);
+        *(LuaHandle*)lua_newuserdata(L, sizeof(LuaHandle)) = *handle;
+        retainHandle(handle);
+        lua_getmetatable(L, 1);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, lua_upvalueindex(3), handle->slot);
+    }
+    lua_pushvalue(L, 3);
+    lua_getmetatable(L, 1);
+    lua_pushcclosure(L, callMethod, 3);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 4, handle->slot);
+    return 1;
+}
+
+static int handleGC(lua_State *L);
+
+// Pushes a handle for an object. All handles of a type share one metatable, which is built on first use.
+template<class T>
+static void pushObject(lua_State *L, T * obj) {
+    LuaHandle * handle = (LuaHandle*)lua_newuserdata(L, sizeof(LuaHandle));
+    *handle = obj->getLuaHandle();
+    obj->retainLuaHandle();
+    lua_pushlightuserdata(L, &LuaType<T>::key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        obj->template toLua<T>(L);
+        lua_newtable(L);
+        lua_newtable(L);
+        lua_pushcclosure(L, handleIndex, 3);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, handleGC);
+        lua_setfield(L, -2, "__gc");
+        lua_pushliteral(L, "object");
+        lua_setfield(L, -2, "__metatable");
+        lua_pushlightuserdata(L, &LuaType<T>::key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_setmetatable(L, -2);
+}
+
+// This imitates the structure of Plethora's objects.
+namespace objects {
+
+    // Interfaces
+
+    struct ObjectGroup;
+
+    class BaseObject {
+        // Removing an object deletes it, and removing a primitive moves the other entries of its layer when the
+        // layer is compacted, so the whole removal happens under the renderer's lock.
+        template<class T>
+        static int _lua_remove(lua_State *L) {
+            T * obj = getUpvalue<T>(L);
+            std::lock_guard<std::mutex> lock(obj->getRenderer()->renderlock);
+            obj->remove();
+            return 0;
+        }
+    protected:
+        ObjectGroup * parent;
+        uint32_t handle = HandleTable::NONE; // slot in the handle table, once the object has been given to Lua
+        uint32_t luaHandles = 0; // handles alive in Lua
+        // Called when the last handle of the object has been garbage collected.
+        virtual void luaHandlesCollected() {}
+        // Cached geometry in canvas coordinates; rebuilt when the object or the transform changes
+        std::vector<SDL_Vertex> vertices;
+        SDL_Texture * texture = NULL;
+        Transform2D cachedTransform;
+        SDL_Rect bounds = {0, 0, 0, 0};
+        bool geometryDirty = true;
+        // Must only touch the object itself, since it may be called from the worker pool.
+        virtual void buildGeometry(GlassesRenderer * ren, SDL_Point transform) {}
+        // For the destructors of canvases: ~BaseObject finds the handle table through the parent, which they don't have.
+        void releaseHandle() {
+            if (handle != HandleTable::NONE) getHandleTable()->release(handle);
+            handle = HandleTable::NONE;
+        }
+    public:
+        BaseObject(ObjectGroup * p): parent(p) {}
+        virtual ~BaseObject();
+        // The virtual destructor passes the size of the actual type, which picks the pool again.
+        static void* operator new(size_t size) {
+            if (size > ObjectPool::MAX_SIZE) return ::operator new(size);
+            return ObjectPool::allocate(size);
+        }
+        static void operator delete(void* ptr, size_t size) {
+            if (size > ObjectPool::MAX_SIZE) ::operator delete(ptr);
+            else ObjectPool::free(ptr, size);
+        }
+        virtual void remove();
+        // Queues the object on the renderer if its geometry needs to be rebuilt.
+        virtual void update(GlassesRenderer * ren, const Transform2D& transform);
+        // Rebuilds the geometry, and marks the area it covered and now covers as damaged.
+        virtual void rebuild(GlassesRenderer * ren, const Transform2D& transform);
+        // Recomputes bounds that depend on other objects, once their geometry has been rebuilt.
+        virtual void updateBounds() {}
+        // Rough amount of work a rebuild takes, in points.
+        virtual size_t geometryCost() const {return 1;}
+        // Adds the cached geometry to the frame if it's inside the clip rectangle.
+        virtual void draw(GlassesRenderer * ren, const SDL_Rect& clip);
+        // Adds the triangles of a 3D object to the scene, given the view space transform of its group.
+        virtual void project(Scene3D& scene, const Transform3D& transform) {}
+        virtual SDL_Rect getBounds() const {return bounds;}
+        virtual void setDirty();
+        virtual HandleTable * getHandleTable() const;
+        // The renderer drawing the object. The Lua methods that add, remove or resize objects hold its renderlock,
+        // since the render thread and the geometry workers walk the tree while a frame is drawn.
+        virtual GlassesRenderer * getRenderer() const;
+        // Pushes a handle for the object, with the metatable of its concrete type.
+        virtual void pushLua(lua_State *L) = 0;
+        LuaHandle getLuaHandle() {
+            HandleTable * table = getHandleTable();
+            if (handle == HandleTable::NONE) handle = table->add(this);
+            return {table, handle, table->generation(handle)};
+        }
+        void retainLuaHandle() {luaHandles++;}
+        // Returns the number of handles left.
+        uint32_t releaseLuaHandle() {
+            const uint32_t left = --luaHandles;
+            if (left == 0) luaHandlesCollected();
+            return left;
+        }
+
+        // Fills the method table of the type's metatable.
+        template<class T>
+        void toLua(lua_State *L) {
+            lua_newtable(L);
+            addLuaMethod(remove);
+        }
+    };
+
+    // The base of every concrete type of object, which pushes handles with the metatable of that exact type.
+    template<class Derived, class Base>
+    class LuaObject: public Base {
+    public:
+        using Base::Base;
+        virtual void pushLua(lua_State *L) override {
+            pushObject(L, static_cast<Derived*>(this));
+        }
+    };
+
+    struct Colorable {
+        static const unsigned int DEFAULT_COLOR = 0xFFFFFFFF;
+        virtual int getAlpha() const = 0;
+        virtual unsigned int getColor() const = 0;
+        virtual void setAlpha(int alpha) = 0;
+        virtual void setColor(unsigned int rgb) = 0;
+        virtual void setColor(int r, int g, int b, int a = 255) = 0;
+
+        template<class T>
+        void toLua(lua_State *L) {
+            addLuaMethod(getAlpha)
+            addLuaMethod(getColor)
+            addLuaMethod(setAlpha)
+            addLuaMethod(setColor)
+        }
     private:
         LuaGetMethod(Colorable, getAlpha, integer)
         LuaGetMethod(Colorable, getColor, integer)
@@ -275,8 +1658,7 @@ namespace objects {
         }
         template<class T>
         static int _lua_setColor(lua_State *L) {
-            T * obj = *(T**)lua_touserdata(L, lua_upvalueindex(1));
-            if (obj == NULL) luaL_error(L, "object does not exist");
+            T * obj = getUpvalue<T>(L);
             if (!lua_isnoneornil(L, 2)) obj->setColor(luaL_checkinteger(L, 1) & 0xFF, luaL_checkinteger(L, 2) & 0xFF, luaL_checkinteger(L, 3) & 0xFF, luaL_optinteger(L, 4, 0xFF) & 0xFF);
             else obj->setColor(luaL_checkinteger(L, 1) & 0xFFFFFFFF);
             return 0;
@@ -288,7 +1670,7 @@ namespace objects {
         virtual void setItem(Item item) = 0;
         
         template<class T>
-        void toLua(lua_State *L, void* ptr) {
+        void toLua(lua_State *L) {
             addLuaMethod(getItem)
             addLuaMethod(setItem)
         }
@@ -309,18 +1691,27 @@ namespace objects {
 
     struct ObjectGroup {
         std::vector<BaseObject*> children;
+        GlassesRenderer * renderer = NULL; // the renderer the canvas belongs to
         ~ObjectGroup() {
             for (BaseObject * o : children) delete o;
         }
         virtual void clear() = 0;
         virtual void setDirty() = 0;
+        // Marks an area of the canvas as needing to be redrawn.
+        virtual void invalidate(const SDL_Rect& rect) = 0;
         // MARK: LuaObject
         template<class T>
-        void toLua(lua_State *L, void* ptr) {
+        void toLua(lua_State *L) {
             addLuaMethod(clear)
         }
     private:
-        LuaVoidMethod(ObjectGroup, clear)
+        template<class T>
+        static int _lua_clear(lua_State *L) {
+            T * group = getUpvalue<T>(L);
+            std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+            group->clear();
+            return 0;
+        }
     };
 
     struct Scalable {
@@ -328,7 +1719,7 @@ namespace objects {
         virtual void setScale(double scale) = 0;
         // MARK: LuaObject
         template<class T>
-        void toLua(lua_State *L, void* ptr) {
+        void toLua(lua_State *L) {
             addLuaMethod(getScale)
             addLuaMethod(setScale)
         }
@@ -346,7 +1737,7 @@ namespace objects {
         virtual void setText(const char * text) = 0;
         // MARK: LuaObject
         template<class T>
-        void toLua(lua_State *L, void* ptr) {
+        void toLua(lua_State *L) {
             addLuaMethod(getLineHeight)
             addLuaMethod(getText)
             addLuaMethod(hasShadow)
@@ -359,7 +1750,14 @@ namespace objects {
         LuaGetMethod(TextObject, getText, string)
         LuaGetMethod(TextObject, hasShadow, boolean)
         LuaSetMethod(TextObject, setLineHeight, integer)
-        LuaSetMethod(TextObject, setText, string)
+        template<class T>
+        static int _lua_setText(lua_State *L) {
+            T * obj = getUpvalue<T>(L);
+            const char * text = luaL_checkstring(L, 1);
+            std::lock_guard<std::mutex> lock(obj->getRenderer()->renderlock); // the text is laid out on the render thread
+            obj->setText(text);
+            return 0;
+        }
         template<class T>
         static int _lua_setShadow(lua_State *L) {
             getUpvalue<T>(L)->setShadow(lua_toboolean(L, 1));
@@ -379,9 +1777,9 @@ namespace objects {
         // MARK: LuaObject
 
         template<class T>
-        void toLua(lua_State *L, void* ptr) {
-            BaseObject::toLua<T>(L, ptr);
-            Colorable::toLua<T>(L, ptr);
+        void toLua(lua_State *L) {
+            BaseObject::toLua<T>(L);
+            Colorable::toLua<T>(L);
         }
 
         // MARK: Colorable
@@ -401,6 +1799,7 @@ namespace objects {
 
         virtual void setColor(unsigned int rgb) override {
             color = rgb;
+            setDirty();
         }
 
         virtual void setColor(int r, int g, int b, int a = 255) override {
@@ -418,7 +1817,7 @@ namespace objects {
             virtual void setPosition(SDL_Point pos) = 0;
             // MARK: LuaObject
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
+            void toLua(lua_State *L) {
                 addLuaMethod(getPosition)
                 addLuaMethod(setPosition)
             }
@@ -437,21 +1836,57 @@ namespace objects {
             }
         };
 
+        // Frames placed in the 3D canvas are both 2D groups and 3D objects, so this interface and Positionable3D,
+        // whose methods would clash with Rotatable3D and Positionable2D, use suffixed C++ names. Lua sees the plain names.
+        struct Transformable2D {
+            virtual float getRotation2D() const = 0;
+            virtual void setRotation2D(float degrees) = 0;
+            virtual SDL_FPoint getScale2D() const = 0;
+            virtual void setScale2D(SDL_FPoint scale) = 0;
+            // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                lua_pushcfunction(L, _lua_getRotation2D<T>);
+                lua_setfield(L, -2, "getRotation");
+                lua_pushcfunction(L, _lua_setRotation2D<T>);
+                lua_setfield(L, -2, "setRotation");
+                lua_pushcfunction(L, _lua_getScale2D<T>);
+                lua_setfield(L, -2, "getScale");
+                lua_pushcfunction(L, _lua_setScale2D<T>);
+                lua_setfield(L, -2, "setScale");
+            }
+        private:
+            LuaGetMethod(Transformable2D, getRotation2D, number)
+            LuaSetMethod(Transformable2D, setRotation2D, number)
+            template<class T>
+            static int _lua_getScale2D(lua_State *L) {
+                SDL_FPoint s = getUpvalue<T>(L)->getScale2D();
+                lua_pushnumber(L, s.x);
+                lua_pushnumber(L, s.y);
+                return 2;
+            }
+            template<class T>
+            static int _lua_setScale2D(lua_State *L) {
+                const float x = luaL_checknumber(L, 1), y = luaL_optnumber(L, 2, x);
+                getUpvalue<T>(L)->setScale2D({x, y});
+                return 0;
+            }
+        };
+
         struct MultiPoint2D {
             virtual int getPointCount() const = 0;
             virtual SDL_Point getPoint(int idx) const = 0;
             virtual void setPoint(int idx, SDL_Point pt) = 0;
             // MARK: LuaObject
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
+            void toLua(lua_State *L) {
                 addLuaMethod(getPoint)
                 addLuaMethod(setPoint)
             }
         private:
             template<class T>
             static int _lua_getPoint(lua_State *L) {
-                T * obj = *(T**)lua_touserdata(L, lua_upvalueindex(1));
-                if (obj == NULL) luaL_error(L, "object does not exist");
+                T * obj = getUpvalue<T>(L);
                 int idx = luaL_checkinteger(L, 1);
                 if (idx < 1 || idx > obj->getPointCount()) luaL_error(L, "bad argument #1 (index out of range)");
                 SDL_Point p = obj->getPoint(idx - 1);
@@ -461,8 +1896,7 @@ namespace objects {
             }
             template<class T>
             static int _lua_setPoint(lua_State *L) {
-                T * obj = *(T**)lua_touserdata(L, lua_upvalueindex(1));
-                if (obj == NULL) luaL_error(L, "object does not exist");
+                T * obj = getUpvalue<T>(L);
                 int idx = luaL_checkinteger(L, 1);
                 if (idx < 1 || idx > obj->getPointCount()) luaL_error(L, "bad argument #1 (index out of range)");
                 obj->setPoint(idx - 1, {(int)luaL_checkinteger(L, 2), (int)luaL_checkinteger(L, 3)});
@@ -473,33 +1907,52 @@ namespace objects {
         struct MultiPointResizable2D: public MultiPoint2D {
             virtual void insertPoint(int x, int y, int idx = INT_MAX) = 0;
             virtual void removePoint(int idx) = 0;
+            // Replaces all points at once, so the shape is only rebuilt once.
+            virtual void setPoints(const SDL_Point * pts, size_t count) = 0;
             // MARK: LuaObject
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                MultiPoint2D::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                MultiPoint2D::toLua<T>(L);
                 addLuaMethod(getPointCount)
                 addLuaMethod(insertPoint)
                 addLuaMethod(removePoint)
+                addLuaMethod(setPoints)
             }
         private:
             LuaGetMethod(MultiPoint2D, getPointCount, integer)
+            // The points are reallocated, so they're only changed under the renderer's lock, after the arguments are checked.
+            template<class T>
+            static int _lua_setPoints(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                luaL_checkpoints(L, 1, pointBuffer);
+                std::lock_guard<std::mutex> lock(obj->getRenderer()->renderlock);
+                obj->setPoints(pointBuffer.data(), pointBuffer.size());
+                return 0;
+            }
             template<class T>
             static int _lua_insertPoint(lua_State *L) {
-                T * obj = *(T**)lua_touserdata(L, lua_upvalueindex(1));
-                if (obj == NULL) luaL_error(L, "object does not exist");
+                T * obj = getUpvalue<T>(L);
+                int idx = INT_MAX, x, y;
                 if (!lua_isnoneornil(L, 3)) {
-                    int idx = luaL_checkinteger(L, 1);
+                    idx = luaL_checkinteger(L, 1);
                     if (idx < 1) luaL_error(L, "bad argument #1 (index out of range)");
-                    obj->insertPoint(luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), idx - 1);
-                } else obj->insertPoint(luaL_checkinteger(L, 1), luaL_checkinteger(L, 2));
+                    idx--;
+                    x = luaL_checkinteger(L, 2);
+                    y = luaL_checkinteger(L, 3);
+                } else {
+                    x = luaL_checkinteger(L, 1);
+                    y = luaL_checkinteger(L, 2);
+                }
+                std::lock_guard<std::mutex> lock(obj->getRenderer()->renderlock);
+                obj->insertPoint(x, y, idx);
                 return 0;
             }
             template<class T>
             static int _lua_removePoint(lua_State *L) {
-                T * obj = *(T**)lua_touserdata(L, lua_upvalueindex(1));
-                if (obj == NULL) luaL_error(L, "object does not exist");
+                T * obj = getUpvalue<T>(L);
                 int idx = luaL_checkinteger(L, 1);
                 if (idx < 1 || idx > obj->getPointCount()) luaL_error(L, "bad argument #1 (index out of range)");
+                std::lock_guard<std::mutex> lock(obj->getRenderer()->renderlock);
                 obj->removePoint(idx - 1);
                 return 0;
             }
@@ -507,102 +1960,921 @@ namespace objects {
 
         // Classes
 
-        class Dot: public ColorableObject, Positionable2D, Scalable {
-            SDL_Point position = {0, 0};
-            double scale = 1.0;
+        class Primitive2D;
+
+        // Dots, lines, rectangles and triangles aren't separate objects: each run of them in a group is stored in
+        // a layer, as structure-of-arrays in drawing order, and the geometry of the whole layer is built in one loop.
+        // The objects Lua sees are facades over an entry of the layer, which are only created when a handle is needed.
+        class PrimitiveLayer: public BaseObject {
+            // Entries are referred to by id, which stays the same when the arrays are compacted.
+            // Free ids are linked through entryIndex.
+            std::vector<uint32_t> entryIndex;
+            std::vector<uint32_t> entryGeneration;
+            std::vector<Primitive2D*> facades;
+            uint32_t freeIds = HandleTable::NONE;
+            size_t removed = 0;
+            // Each entry has a span of vertices of a fixed size for its kind, padded with empty triangles, so changing
+            // an entry only rewrites its own span and only damages what it covered before and after.
+            std::vector<uint32_t> firstVertex;
+            std::vector<Uint8> spans;
+            std::vector<SDL_Rect> entryBounds; // what each entry covered when its span was last written
+            mutable std::mutex changedLock; // facades are changed on the computer's thread while the layer is rebuilt
+            std::vector<size_t> changed, patching; // indices of the entries changed since the last rebuild
+            std::vector<SDL_Vertex> scratch;
+            size_t built = 0; // entries with a span; the ones after them were added since
+            bool rebuildAll = true; // compacting moved the entries, so every span has to be laid out again
+
+            // Writes the vertices of an entry into its span, and records the area they cover.
+            void writeEntry(size_t i, const Transform2D& transform);
+
+            void compact() {
+                size_t j = 0;
+                for (size_t i = 0; i < kinds.size(); i++) {
+                    if (kinds[i] == Removed) continue;
+                    kinds[j] = kinds[i];
+                    p1[j] = p1[i];
+                    p2[j] = p2[i];
+                    p3[j] = p3[i];
+                    colors[j] = colors[i];
+                    sizes[j] = sizes[i];
+                    ids[j] = ids[i];
+                    entryIndex[ids[j]] = j;
+                    j++;
+                }
+                kinds.resize(j);
+                p1.resize(j);
+                p2.resize(j);
+                p3.resize(j);
+                colors.resize(j);
+                sizes.resize(j);
+                ids.resize(j);
+                removed = 0;
+                rebuildAll = true;
+            }
+        public:
+            enum Kind: Uint8 {Removed, DotKind, LineKind, RectangleKind, TriangleKind};
+            std::vector<Uint8> kinds;
+            std::vector<SDL_Point> p1, p2, p3; // position and size of dots and rectangles, ends or corners of the others
+            std::vector<unsigned int> colors;
+            std::vector<float> sizes; // dot size or line thickness
+            std::vector<uint32_t> ids;
+
+            PrimitiveLayer(ObjectGroup * p): BaseObject(p) {}
+            virtual ~PrimitiveLayer();
+
+            uint32_t add(Kind kind, SDL_Point a, SDL_Point b, SDL_Point c, unsigned int color, float size) {
+                uint32_t id = freeIds;
+                if (id == HandleTable::NONE) {
+                    id = entryIndex.size();
+                    entryIndex.push_back(0);
+                    entryGeneration.push_back(0);
+                    facades.push_back(NULL);
+                } else freeIds = entryIndex[id];
+                entryIndex[id] = kinds.size();
+                kinds.push_back(kind);
+                p1.push_back(a);
+                p2.push_back(b);
+                p3.push_back(c);
+                colors.push_back(color);
+                sizes.push_back(size);
+                ids.push_back(id);
+                setDirty();
+                return id;
+            }
+
+            size_t index(uint32_t id) const {
+                return entryIndex[id];
+            }
+
+            // Queues the entry at an index to have its span rewritten.
+            void entryChanged(size_t i) {
+                {
+                    std::lock_guard<std::mutex> lock(changedLock);
+                    changed.push_back(i);
+                }
+                setDirty();
+            }
+
+            uint32_t generation(uint32_t id) const {
+                return entryGeneration[id];
+            }
+
+            // Returns the facade of an entry, creating it if needed, or NULL if the entry has been removed since.
+            // Facades are only made for Lua handles, and deleted again once those are collected.
+            Primitive2D * getFacade(uint32_t id, uint32_t gen);
+            static Primitive2D * getFacade(ObjectRef ref) {
+                PrimitiveLayer * layer = static_cast<PrimitiveLayer*>(ref.obj);
+                return layer->getFacade(ref.entry, layer->generation(ref.entry));
+            }
+            void dropFacade(uint32_t id);
+            // Removes an entry and its facade; removes the layer itself once it's empty.
+            // Must be called with the renderer's lock held, since it may compact the layer.
+            void erase(uint32_t id);
+
+            // MARK: BaseObject
+
+            // Only rewrites the spans of changed and added entries, unless the transform changed or the layer was compacted.
+            virtual void rebuild(GlassesRenderer * ren, const Transform2D& transform) override;
+
+            virtual size_t geometryCost() const override {
+                if (rebuildAll) return kinds.size();
+                std::lock_guard<std::mutex> lock(changedLock);
+                return changed.size() + kinds.size() - built;
+            }
+
+            // MARK: LuaObject
+
+            // Layers are never given to Lua; their entries are.
+            virtual void pushLua(lua_State *L) override {
+                lua_pushnil(L);
+            }
+        };
+
+        // An entry of a primitive layer, as an object.
+        class Primitive2D: public BaseObject, Colorable {
+        protected:
+            PrimitiveLayer * layer;
+            uint32_t id;
+            size_t index() const {return layer->index(id);}
         public:
-            Dot(ObjectGroup * p): ColorableObject(p) {}
+            Primitive2D(ObjectGroup * p, PrimitiveLayer * l, uint32_t i): BaseObject(p), layer(l), id(i) {}
 
             // MARK: BaseObject
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                boxColor(ren->ren, transform.x + position.x - scale, transform.y + position.y - scale, transform.x + position.x + scale, transform.y + position.y + scale, SDL_SwapBE32(color));
+            virtual void remove() override {
+                layer->erase(id);
+            }
+
+            virtual void setDirty() override {
+                layer->entryChanged(index());
+            }
+
+            virtual void luaHandlesCollected() override {
+                layer->dropFacade(id); // deletes this
+            }
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                BaseObject::toLua<T>(L);
+                Colorable::toLua<T>(L);
+            }
+
+            // MARK: Colorable
+
+            virtual int getAlpha() const override {
+                return layer->colors[index()] & 0xFF;
+            }
+
+            virtual unsigned int getColor() const override {
+                return layer->colors[index()];
+            }
+
+            virtual void setAlpha(int alpha) override {
+                unsigned int& color = layer->colors[index()];
+                color = (color & 0xFFFFFF00) | alpha;
+                setDirty();
+            }
+
+            virtual void setColor(unsigned int rgb) override {
+                layer->colors[index()] = rgb;
+                setDirty();
+            }
+
+            virtual void setColor(int r, int g, int b, int a = 255) override {
+                layer->colors[index()] = (r << 24) | (g << 16) | (b << 8) | a;
+                setDirty();
             }
+        };
+
+        class Dot: public LuaObject<Dot, Primitive2D>, Positionable2D, Scalable {
+        public:
+            Dot(ObjectGroup * p, PrimitiveLayer * l, uint32_t i): LuaObject(p, l, i) {}
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                Positionable2D::toLua<T>(L, ptr);
-                Scalable::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                Primitive2D::toLua<T>(L);
+                Positionable2D::toLua<T>(L);
+                Scalable::toLua<T>(L);
             }
 
             // MARK: Positionable2D
 
             virtual SDL_Point getPosition() const override {
-                return position;
+                return layer->p1[index()];
             }
 
             virtual void setPosition(SDL_Point pos) override {
-                position = pos;
+                layer->p1[index()] = pos;
                 setDirty();
             }
 
             // MARK: Scalable
 
             virtual double getScale() const override {
-                return scale;
+                return layer->sizes[index()];
             }
 
             virtual void setScale(double s) override {
-                scale = s;
+                layer->sizes[index()] = s;
                 setDirty();
             }
         };
 
-        class Line: public ColorableObject, Scalable, MultiPoint2D {
-            SDL_Point start = {0, 0}, end = {0, 0};
-            double scale = 1.0;
+        class Line: public LuaObject<Line, Primitive2D>, Scalable, MultiPoint2D {
         public:
-            Line(ObjectGroup * p): ColorableObject(p) {}
+            Line(ObjectGroup * p, PrimitiveLayer * l, uint32_t i): LuaObject(p, l, i) {}
 
-            // MARK: BaseObject
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                Primitive2D::toLua<T>(L);
+                Scalable::toLua<T>(L);
+                MultiPoint2D::toLua<T>(L);
+            }
+
+            // MARK: Scalable
+
+            virtual double getScale() const override {
+                return layer->sizes[index()];
+            }
+
+            virtual void setScale(double s) override {
+                layer->sizes[index()] = s;
+                setDirty();
+            }
+
+            // MARK: MultiPoint2D
+
+            virtual int getPointCount() const override {
+                return 2;
+            }
+
+            virtual SDL_Point getPoint(int idx) const override {
+                return idx ? layer->p2[index()] : layer->p1[index()];
+            }
+
+            virtual void setPoint(int idx, SDL_Point pt) override {
+                if (idx) layer->p2[index()] = pt;
+                else layer->p1[index()] = pt;
+                setDirty();
+            }
+
+        };
+
+        class Rectangle: public LuaObject<Rectangle, Primitive2D>, Positionable2D {
+            template<class T>
+            static int _lua_getSize(lua_State *L) {
+                SDL_Point p = getUpvalue<T>(L)->getSize();
+                lua_pushinteger(L, p.x);
+                lua_pushinteger(L, p.y);
+                return 2;
+            }
+            template<class T>
+            static int _lua_setSize(lua_State *L) {
+                getUpvalue<T>(L)->setSize({(int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2)});
+                return 0;
+            }
+        public:
+            Rectangle(ObjectGroup * p, PrimitiveLayer * l, uint32_t i): LuaObject(p, l, i) {}
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                thickLineColor_ren(ren->ren, transform.x + start.x, transform.y + start.y, transform.x + end.x, transform.y + end.y, scale, color);
+            SDL_Point getSize() const {
+                return layer->p2[index()];
+            }
+
+            void setSize(SDL_Point size) {
+                layer->p2[index()] = size;
+                setDirty();
             }
 
             // MARK: LuaObject
 
-            template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                Scalable::toLua<T>(L, ptr);
-                MultiPoint2D::toLua<T>(L, ptr);
+            template<class T>
+            void toLua(lua_State *L) {
+                Primitive2D::toLua<T>(L);
+                Positionable2D::toLua<T>(L);
+                addLuaMethod(getSize)
+                addLuaMethod(setSize)
+            }
+
+            // MARK: Positionable2D
+
+            virtual SDL_Point getPosition() const override {
+                return layer->p1[index()];
+            }
+
+            virtual void setPosition(SDL_Point pos) override {
+                layer->p1[index()] = pos;
+                setDirty();
+            }
+
+        };
+
+        class Triangle: public LuaObject<Triangle, Primitive2D>, MultiPoint2D {
+            std::vector<SDL_Point>& corner(int idx) const {
+                return idx == 0 ? layer->p1 : idx == 1 ? layer->p2 : layer->p3;
+            }
+        public:
+            Triangle(ObjectGroup * p, PrimitiveLayer * l, uint32_t i): LuaObject(p, l, i) {}
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                Primitive2D::toLua<T>(L);
+                MultiPoint2D::toLua<T>(L);
+            }
+
+            // MARK: MultiPoint2D
+
+            virtual int getPointCount() const override {
+                return 3;
+            }
+
+            virtual SDL_Point getPoint(int idx) const override {
+                return corner(idx)[index()];
+            }
+
+            virtual void setPoint(int idx, SDL_Point pt) override {
+                corner(idx)[index()] = pt;
+                setDirty();
+            }
+        };
+
+        class Polygon: public LuaObject<Polygon, ColorableObject>, MultiPointResizable2D {
+        protected:
+            std::vector<SDL_Point> points;
+            std::vector<SDL_FPoint> tris; // three corners per triangle
+            bool pointsDirty = true;
+        public:
+            Polygon(ObjectGroup * p): LuaObject(p) {}
+
+            // MARK: BaseObject
+
+            virtual void buildGeometry(GlassesRenderer * ren, SDL_Point transform) override {
+                if (points.empty()) return;
+                if (pointsDirty) {
+                    triangulate(points, tris);
+                    ren->stats.triangulations.fetch_add(1, std::memory_order_relaxed);
+                    pointsDirty = false;
+                }
+                const SDL_Color c = {rgba(color)};
+                vertices.reserve(tris.size());
+                for (const SDL_FPoint& p : tris) vertices.push_back({{transform.x + p.x, transform.y + p.y}, c, {0, 0}});
+            }
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                ColorableObject::toLua<T>(L);
+                MultiPointResizable2D::toLua<T>(L);
+            }
+
+            // MARK: MultiPoint2D
+
+            virtual size_t geometryCost() const override {
+                return points.size();
+            }
+
+            virtual int getPointCount() const override {
+                return points.size();
+            }
+
+            virtual SDL_Point getPoint(int idx) const override {
+                return points[idx];
+            }
+
+            virtual void setPoint(int idx, SDL_Point pt) override {
+                points[idx] = pt;
+                setDirty();
+                pointsDirty = true;
+            }
+
+            // MARK: MultiPointResizable2D
+
+            virtual void insertPoint(int x, int y, int idx = INT_MAX) override {
+                if (idx < 0 || (size_t)idx >= points.size()) points.push_back({x, y});
+                else points.insert(points.begin() + idx, {x, y});
+                setDirty();
+                pointsDirty = true;
+            }
+
+            virtual void removePoint(int idx) override {
+                points.erase(points.begin() + idx);
+                setDirty();
+                pointsDirty = true;
+            }
+
+            virtual void setPoints(const SDL_Point * pts, size_t count) override {
+                points.assign(pts, pts + count);
+                setDirty();
+                pointsDirty = true;
+            }
+
+        };
+
+        // TODO: fix thickness
+        class LineLoop: public LuaObject<LineLoop, Polygon>, Scalable {
+            double scale = 1.0;
+        public:
+            LineLoop(ObjectGroup * p): LuaObject(p) {}
+
+            // MARK: BaseObject
+
+            virtual void buildGeometry(GlassesRenderer * ren, SDL_Point transform) override {
+                if (points.size() > 2) {
+                    for (size_t i = 0; i < points.size() - 1; i++) {
+                        pushThickLine(vertices, transform.x + points[i].x, transform.y + points[i].y, transform.x + points[i+1].x, transform.y + points[i+1].y, scale, color);
+                    }
+                }
+                if (points.size() > 1) pushThickLine(vertices, transform.x + points.back().x, transform.y + points.back().y, transform.x + points.front().x, transform.y + points.front().y, scale, color);
+            }
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                Polygon::toLua<T>(L);
+                Scalable::toLua<T>(L);
+            }
+
+            // MARK: Scalable
+
+            virtual double getScale() const override {
+                return scale;
+            }
+
+            virtual void setScale(double s) override {
+                scale = s;
+                setDirty();
+            }
+
+        };
+
+        class Text: public LuaObject<Text, ColorableObject>, Positionable2D, Scalable, TextObject {
+            struct GlyphQuad {
+                SDL_Rect dst; // relative to the text position
+                SDL_Rect src; // in the atlas
+            };
+            SDL_Point position = {0, 0};
+            double scale = 1.0;
+            std::string text;
+            bool shadow = false;
+            int lineHeight = 0;
+            // Layout cache: only rebuilt when the text, scale or line height change
+            GlyphAtlas * layoutFont = NULL;
+            bool layoutDirty = true;
+            std::vector<GlyphQuad> quads;
+            int atlasHeight = 0; // atlas height the cached texture coordinates were computed for
+
+            void layout(GlyphAtlas * font) {
+                quads.clear();
+                std::vector<std::string> lines = split(text);
+                for (size_t i = 0; i < lines.size(); i++) {
+                    int x = 0;
+                    for (unsigned char c : lines[i]) {
+                        const GlyphAtlas::Glyph& g = font->getGlyph(c);
+                        if (g.src.w > 0 && g.src.h > 0) quads.push_back({{x, (int)i * lineHeight, g.src.w, g.src.h}, g.src});
+                        x += g.advance;
+                    }
+                }
+                layoutFont = font;
+                layoutDirty = false;
+            }
+        public:
+            Text(ObjectGroup * p): LuaObject(p) {}
+
+            // MARK: BaseObject
+
+            virtual void update(GlassesRenderer * ren, const Transform2D& transform) override {
+                GlyphAtlas * font = ren->getFont((int)scale);
+                if (font == NULL) return;
+                if (layoutDirty || font != layoutFont) {
+                    layout(font);
+                    ren->stats.textLayouts.fetch_add(1, std::memory_order_relaxed);
+                    geometryDirty = true;
+                }
+                // The texture coordinates change when the atlas grows.
+                if (font->surface->h != atlasHeight) geometryDirty = true;
+                ColorableObject::update(ren, transform);
+            }
+
+            virtual void buildGeometry(GlassesRenderer * ren, SDL_Point transform) override {
+                texture = layoutFont->texture;
+                atlasHeight = layoutFont->surface->h;
+                const float tw = layoutFont->width, th = atlasHeight;
+                const SDL_Color c = {rgba(color)};
+                vertices.resize(quads.size() * 6);
+                SDL_Vertex * v = vertices.data();
+                for (const GlyphQuad& q : quads) {
+                    const float x1 = transform.x + position.x + q.dst.x, y1 = transform.y + position.y + q.dst.y;
+                    const float x2 = x1 + q.dst.w, y2 = y1 + q.dst.h;
+                    const float u1 = q.src.x / tw, v1 = q.src.y / th, u2 = (q.src.x + q.src.w) / tw, v2 = (q.src.y + q.src.h) / th;
+                    *v++ = {{x1, y1}, c, {u1, v1}};
+                    *v++ = {{x2, y1}, c, {u2, v1}};
+                    *v++ = {{x1, y2}, c, {u1, v2}};
+                    *v++ = {{x2, y1}, c, {u2, v1}};
+                    *v++ = {{x2, y2}, c, {u2, v2}};
+                    *v++ = {{x1, y2}, c, {u1, v2}};
+                }
+            }
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                ColorableObject::toLua<T>(L);
+                Positionable2D::toLua<T>(L);
+                Scalable::toLua<T>(L);
+                TextObject::toLua<T>(L);
+            }
+
+            // MARK: Positionable2D
+
+            virtual SDL_Point getPosition() const override {
+                return position;
+            }
+
+            virtual void setPosition(SDL_Point pos) override {
+                position = pos;
+                setDirty();
+            }
+
+            // MARK: Scalable
+
+            virtual double getScale() const override {
+                return scale;
+            }
+
+            virtual void setScale(double s) override {
+                scale = s;
+                layoutDirty = true;
+                setDirty();
+            }
+        
+            // MARK: TextObject
+
+            virtual int getLineHeight() const override {
+                return lineHeight;
+            }
+
+            virtual const char * getText() const override {
+                return text.c_str();
+            }
+
+            virtual bool hasShadow() const override {
+                return shadow;
+            }
+
+            virtual void setLineHeight(int height) override {
+                lineHeight = height;
+                layoutDirty = true;
+                setDirty();
+            }
+
+            virtual void setShadow(bool s) override {
+                shadow = s;
+                setDirty();
+            }
+
+            virtual void setText(const char * t) override {
+                text = t;
+                layoutDirty = true;
+                setDirty();
+            }
+
+        };
+
+        class ObjectGroup2D;
+
+        // Interface (but this needs to be below the rest)
+        struct Group2D: public ObjectGroup {
+            // Dots, lines, rectangles and triangles are entries of a layer; see PrimitiveLayer::getFacade.
+            virtual ObjectRef addDot(SDL_Point pos, unsigned int color = Colorable::DEFAULT_COLOR, int size = 1) = 0;
+            virtual ObjectGroup2D * addGroup(SDL_Point pos) = 0;
+            virtual ObjectRef addLine(SDL_Point start, SDL_Point end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) = 0;
+            virtual LineLoop * addLines(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) = 0;
+            virtual Polygon * addPolygon(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
+            virtual ObjectRef addRectangle(int x, int y, int width, int height, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
+            virtual Text * addText(SDL_Point pos, const std::string& contents, unsigned int color = Colorable::DEFAULT_COLOR, double size = 1.0) = 0;
+            virtual ObjectRef addTriangle(SDL_Point p1, SDL_Point p2, SDL_Point p3, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
+            // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                ObjectGroup::toLua<T>(L);
+                addLuaMethod(addDot)
+                addLuaMethod(addGroup)
+                addLuaMethod(addLine)
+                addLuaMethod(addLines)
+                addLuaMethod(addObjects)
+                addLuaMethod(addPolygon)
+                addLuaMethod(addRectangle)
+                addLuaMethod(addText)
+                addLuaMethod(addTriangle)
+            }
+        private:
+            static void pushPrimitive(lua_State *L, ObjectRef ref) {
+                PrimitiveLayer::getFacade(ref)->pushLua(L);
+            }
+            // Adding to a group changes the tree the render thread walks, so the objects are added under the renderer's
+            // lock. The arguments are read first, since a Lua error would leave the lock held.
+            template<class T>
+            static int _lua_addDot(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const SDL_Point pos = luaL_checkpoint(L, 1);
+                const unsigned int color = luaL_optinteger(L, 2, 0xFFFFFFFF);
+                const int size = luaL_optinteger(L, 3, 1);
+                ObjectRef ref;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    ref = group->addDot(pos, color, size);
+                }
+                pushPrimitive(L, ref);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addGroup(lua_State *L);
+            template<class T>
+            static int _lua_addObjects(lua_State *L);
+            template<class T>
+            static int _lua_addLine(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const SDL_Point start = luaL_checkpoint(L, 1), end = luaL_checkpoint(L, 2);
+                const unsigned int color = luaL_optinteger(L, 3, 0xFFFFFFFF);
+                const double thickness = luaL_optnumber(L, 4, 1.0);
+                ObjectRef ref;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    ref = group->addLine(start, end, color, thickness);
+                }
+                pushPrimitive(L, ref);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addLines(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                luaL_checkpoints(L, 1, pointBuffer);
+                const unsigned int color = luaL_optinteger(L, 2, 0xFFFFFFFF);
+                const double thickness = luaL_optnumber(L, 3, 1.0);
+                LineLoop * obj;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    obj = group->addLines(pointBuffer, color, thickness);
+                }
+                pushObject(L, obj);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addPolygon(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                luaL_checkpoints(L, 1, pointBuffer);
+                const unsigned int color = luaL_optinteger(L, 2, 0xFFFFFFFF);
+                Polygon * obj;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    obj = group->addPolygon(pointBuffer, color);
+                }
+                pushObject(L, obj);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addRectangle(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const int x = luaL_checkinteger(L, 1), y = luaL_checkinteger(L, 2), w = luaL_checkinteger(L, 3), h = luaL_checkinteger(L, 4);
+                const unsigned int color = luaL_optinteger(L, 5, 0xFFFFFFFF);
+                ObjectRef ref;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    ref = group->addRectangle(x, y, w, h, color);
+                }
+                pushPrimitive(L, ref);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addText(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const SDL_Point pos = luaL_checkpoint(L, 1);
+                const char * text = luaL_checkstring(L, 2);
+                const unsigned int color = luaL_optinteger(L, 3, 0xFFFFFFFF);
+                const double size = luaL_optnumber(L, 4, 1.0);
+                Text * obj;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    obj = group->addText(pos, text, color, size);
+                }
+                pushObject(L, obj);
+                return 1;
+            }
+            template<class T>
+            static int _lua_addTriangle(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const SDL_Point p1 = luaL_checkpoint(L, 1), p2 = luaL_checkpoint(L, 2), p3 = luaL_checkpoint(L, 3);
+                const unsigned int color = luaL_optinteger(L, 4, 0xFFFFFFFF);
+                ObjectRef ref;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    ref = group->addTriangle(p1, p2, p3, color);
+                }
+                pushPrimitive(L, ref);
+                return 1;
+            }
+        };
+
+        class ObjectGroup2D: public LuaObject<ObjectGroup2D, BaseObject>, Group2D, Positionable2D, Transformable2D {
+            SDL_Point position = {0, 0};
+            float rotation = 0.0f;
+            SDL_FPoint scale = {1.0f, 1.0f};
+            Transform2D local; // position, rotation and scale, only recomputed when they change
+            unsigned int glyphGeneration = 0; // of the renderer, when the children were last updated
+            bool boundsDirty = true;
+
+            void setLocal() {
+                local = Transform2D::place(position, rotation, scale);
+                setDirty();
+            }
+        public:
+            ObjectGroup2D(ObjectGroup * p, GlassesRenderer * r = NULL): LuaObject(p) {renderer = p ? p->renderer : r;}
+
+            // MARK: BaseObject
+
+            // geometryDirty is set when anything below the group changes, and cachedTransform is the
+            // transform of the children; if neither changed, the whole subtree is skipped.
+            virtual void update(GlassesRenderer * ren, const Transform2D& transform) override {
+                const Transform2D t = transform * local;
+                if (!geometryDirty && t == cachedTransform && glyphGeneration == ren->glyphGeneration) return;
+                geometryDirty = false;
+                cachedTransform = t;
+                glyphGeneration = ren->glyphGeneration;
+                boundsDirty = true;
+                for (BaseObject * obj : children) obj->update(ren, t);
+            }
+
+            virtual void updateBounds() override {
+                if (!boundsDirty) return;
+                boundsDirty = false;
+                SDL_Rect retval = {0, 0, 0, 0};
+                for (BaseObject * obj : children) {
+                    obj->updateBounds();
+                    retval = unionRect(retval, obj->getBounds());
+                }
+                bounds = retval;
+            }
+
+            // Groups outside the clip rectangle (and so the viewport) are skipped with all their children.
+            virtual void draw(GlassesRenderer * ren, const SDL_Rect& clip) override {
+                if (!intersects(bounds, clip)) return;
+                for (BaseObject * obj : children) obj->draw(ren, clip);
+            }
+
+            virtual HandleTable * getHandleTable() const override {
+                return renderer->handles;
+            }
+
+            virtual GlassesRenderer * getRenderer() const override {
+                return renderer;
+            }
+
+            // Creates count objects of a batch, starting at index i. Returns the index after the last one.
+            size_t build(const SceneBatch& batch, size_t i, size_t count, std::vector<ObjectRef>& created);
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                groupToLua<T>(L);
+                Positionable2D::toLua<T>(L);
+                Transformable2D::toLua<T>(L);
+            }
+        protected:
+            // The methods of the group without its position, which frames placed in the 3D canvas replace.
+            template<class T>
+            void groupToLua(lua_State *L) {
+                BaseObject::toLua<T>(L);
+                Group2D::toLua<T>(L);
+            }
+        public:
+
+            // MARK: ObjectGroup
+
+            virtual void clear() override {
+                while (!children.empty()) children.front()->remove();
+                setDirty();
+            }
+
+            virtual void setDirty() override {
+                BaseObject::setDirty();
+            }
+
+            virtual void invalidate(const SDL_Rect& rect) override {
+                parent->invalidate(rect);
+            }
+
+            // MARK: Group2D
+
+            virtual ObjectRef addDot(SDL_Point pos, unsigned int color = Colorable::DEFAULT_COLOR, int size = 1) override {
+                return addPrimitive(PrimitiveLayer::DotKind, pos, {0, 0}, {0, 0}, color, size);
+            }
+
+            virtual ObjectGroup2D * addGroup(SDL_Point pos) override {
+                ObjectGroup2D * retval = new ObjectGroup2D(this);
+                retval->setPosition(pos);
+                children.push_back(retval);
+                setDirty();
+                return retval;
+            }
+
+            virtual ObjectRef addLine(SDL_Point start, SDL_Point end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) override {
+                return addPrimitive(PrimitiveLayer::LineKind, start, end, {0, 0}, color, thickness);
+            }
+
+            virtual LineLoop * addLines(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) override {
+                LineLoop * retval = new LineLoop(this);
+                retval->setPoints(points.data(), points.size());
+                retval->setScale(thickness);
+                retval->setColor(color);
+                children.push_back(retval);
+                setDirty();
+                return retval;
+            }
+
+            virtual Polygon * addPolygon(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR) override {
+                Polygon * retval = new Polygon(this);
+                retval->setPoints(points.data(), points.size());
+                retval->setColor(color);
+                children.push_back(retval);
+                setDirty();
+                return retval;
+            }
+
+            virtual ObjectRef addRectangle(int x, int y, int width, int height, unsigned int color = Colorable::DEFAULT_COLOR) override {
+                return addPrimitive(PrimitiveLayer::RectangleKind, {x, y}, {width, height}, {0, 0}, color, 1.0f);
+            }
+
+            virtual Text * addText(SDL_Point pos, const std::string& contents, unsigned int color = Colorable::DEFAULT_COLOR, double size = 1.0) override {
+                Text * retval = new Text(this);
+                retval->setPosition(pos);
+                retval->setText(contents.c_str());
+                retval->setColor(color);
+                retval->setScale(size);
+                children.push_back(retval);
+                setDirty();
+                return retval;
+            }
+
+            virtual ObjectRef addTriangle(SDL_Point p1, SDL_Point p2, SDL_Point p3, unsigned int color = Colorable::DEFAULT_COLOR) override {
+                return addPrimitive(PrimitiveLayer::TriangleKind, p1, p2, p3, color, 1.0f);
+            }
+
+            // Adds a primitive to the layer at the end of the group, starting a new layer if the last child isn't one.
+            ObjectRef addPrimitive(PrimitiveLayer::Kind kind, SDL_Point a, SDL_Point b, SDL_Point c, unsigned int color, float size) {
+                PrimitiveLayer * layer = children.empty() ? NULL : dynamic_cast<PrimitiveLayer*>(children.back());
+                if (layer == NULL) {
+                    layer = new PrimitiveLayer(this);
+                    children.push_back(layer);
+                }
+                return {layer, layer->add(kind, a, b, c, color, size)};
             }
 
-            // MARK: Scalable
+            // MARK: Positionable2D
 
-            virtual double getScale() const override {
-                return scale;
+            virtual SDL_Point getPosition() const override {
+                return position;
             }
 
-            virtual void setScale(double s) override {
-                scale = s;
-                setDirty();
+            virtual void setPosition(SDL_Point pos) override {
+                position = pos;
+                setLocal();
             }
 
-            // MARK: MultiPoint2D
+            // MARK: Transformable2D
 
-            virtual int getPointCount() const override {
-                return 2;
+            virtual float getRotation2D() const override {
+                return rotation;
             }
 
-            virtual SDL_Point getPoint(int idx) const override {
-                return idx ? end : start;
+            virtual void setRotation2D(float degrees) override {
+                rotation = degrees;
+                setLocal();
             }
 
-            virtual void setPoint(int idx, SDL_Point pt) override {
-                if (idx) end = pt;
-                else start = pt;
-                setDirty();
+            virtual SDL_FPoint getScale2D() const override {
+                return scale;
+            }
+
+            virtual void setScale2D(SDL_FPoint s) override {
+                scale = s;
+                setLocal();
             }
 
         };
 
-        class Rectangle: public ColorableObject, Positionable2D {
-            SDL_Rect rect = {0, 0, 0, 0};
+        class Frame2D: public LuaObject<Frame2D, ObjectGroup2D> {
+            SDL_Point size;
             template<class T>
             static int _lua_getSize(lua_State *L) {
                 SDL_Point p = getUpvalue<T>(L)->getSize();
@@ -610,415 +2882,459 @@ namespace objects {
                 lua_pushinteger(L, p.y);
                 return 2;
             }
-            template<class T>
-            static int _lua_setSize(lua_State *L) {
-                getUpvalue<T>(L)->setSize({(int)luaL_checkinteger(L, 1), (int)luaL_checkinteger(L, 2)});
-                return 0;
-            }
+            std::mutex damageLock;
+            std::vector<SDL_Rect> damage;
         public:
-            Rectangle(ObjectGroup * p): ColorableObject(p) {}
-
-            SDL_Point getSize() const {
-                return {rect.w, rect.h};
+            static constexpr size_t MAX_DAMAGE_RECTS = 16;
+            std::atomic<bool> isDirty;
+            bool fullRedraw = true;
+            Frame2D(SDL_Point sz, GlassesRenderer * r): LuaObject(nullptr, r), size(sz), isDirty(true) {setPosition({0, 0});}
+            ~Frame2D() {
+                releaseHandle();
             }
+            SDL_Point getSize() const {return size;}
 
-            void setSize(SDL_Point size) {
-                rect.w = size.x;
-                rect.h = size.y;
-                setDirty();
+            // Returns the damaged areas since the last call, merged into a few non-overlapping rectangles.
+            std::vector<SDL_Rect> takeDamage() {
+                std::lock_guard<std::mutex> lock(damageLock);
+                std::vector<SDL_Rect> retval;
+                retval.swap(damage);
+                return retval;
             }
 
             // MARK: BaseObject
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                SDL_Rect nr = {transform.x + rect.x, transform.y + rect.y, rect.w, rect.h};
-                SDL_SetRenderDrawColor(ren->ren, rgba(color));
-                SDL_RenderDrawRect(ren->ren, &nr);
+            virtual void remove() override {}
+            virtual void setDirty() override {
+                geometryDirty = true;
+                isDirty = true;
+                wakeRenderLoop();
+            }
+
+            // MARK: ObjectGroup
+
+            virtual void invalidate(const SDL_Rect& r) override {
+                SDL_Rect rect = r;
+                if (!intersects(rect, {0, 0, size.x, size.y})) return;
+                std::lock_guard<std::mutex> lock(damageLock);
+                for (size_t i = 0; i < damage.size();) {
+                    if (intersects(damage[i], rect)) {
+                        rect = unionRect(damage[i], rect);
+                        damage.erase(damage.begin() + i);
+                        i = 0;
+                    } else i++;
+                }
+                damage.push_back(rect);
+                if (damage.size() > MAX_DAMAGE_RECTS) {
+                    // Too many small areas: redrawing their bounding box is cheaper than drawing the scene this many times.
+                    for (size_t i = 1; i < damage.size(); i++) damage[0] = unionRect(damage[0], damage[i]);
+                    damage.resize(1);
+                }
             }
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                Positionable2D::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                ObjectGroup2D::toLua<T>(L);
                 addLuaMethod(getSize)
-                addLuaMethod(setSize)
             }
+        };
 
-            // MARK: Positionable2D
+    };
 
-            virtual SDL_Point getPosition() const override {
-                return {rect.x, rect.y};
-            }
+    namespace object3d {
 
-            virtual void setPosition(SDL_Point pos) override {
-                rect.x = pos.x;
-                rect.y = pos.y;
-                setDirty();
-            }
+        // Interfaces
 
+        // See Transformable2D about the names.
+        struct Positionable3D {
+            virtual Vec3 getPosition3D() const = 0;
+            virtual void setPosition3D(Vec3 pos) = 0;
+            // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                lua_pushcfunction(L, _lua_getPosition3D<T>);
+                lua_setfield(L, -2, "getPosition");
+                lua_pushcfunction(L, _lua_setPosition3D<T>);
+                lua_setfield(L, -2, "setPosition");
+            }
+        private:
+            template<class T>
+            static int _lua_getPosition3D(lua_State *L) {
+                Vec3 p = getUpvalue<T>(L)->getPosition3D();
+                lua_pushnumber(L, p.x);
+                lua_pushnumber(L, p.y);
+                lua_pushnumber(L, p.z);
+                return 3;
+            }
+            template<class T>
+            static int _lua_setPosition3D(lua_State *L) {
+                getUpvalue<T>(L)->setPosition3D({(float)luaL_checknumber(L, 1), (float)luaL_checknumber(L, 2), (float)luaL_checknumber(L, 3)});
+                return 0;
+            }
         };
 
-        class Triangle: public ColorableObject, MultiPoint2D {
-            SDL_Point points[3];
-        public:
-            Triangle(ObjectGroup * p): ColorableObject(p) {}
-
-            // MARK: BaseObject
-
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                SDL_Vertex vertices[3];
-                for (int i = 0; i < 3; i++) vertices[i] = {{(float)points[i].x, (float)points[i].y}, {rgba(color)}, {0, 0}};
-                SDL_RenderGeometry(ren->ren, NULL, vertices, 3, NULL, 0);
+        struct Rotatable3D {
+            // Objects without a rotation are turned to face the camera.
+            virtual bool hasRotation() const = 0;
+            virtual Vec3 getRotation() const = 0;
+            virtual void setRotation(Vec3 degrees) = 0;
+            virtual void clearRotation() = 0;
+            // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                addLuaMethod(getRotation)
+                addLuaMethod(setRotation)
+            }
+        private:
+            template<class T>
+            static int _lua_getRotation(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                if (!obj->hasRotation()) return 0;
+                Vec3 r = obj->getRotation();
+                lua_pushnumber(L, r.x);
+                lua_pushnumber(L, r.y);
+                lua_pushnumber(L, r.z);
+                return 3;
+            }
+            template<class T>
+            static int _lua_setRotation(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                if (lua_isnoneornil(L, 1)) obj->clearRotation();
+                else obj->setRotation({(float)luaL_checknumber(L, 1), (float)luaL_checknumber(L, 2), (float)luaL_checknumber(L, 3)});
+                return 0;
             }
+        };
 
+        struct DepthTestable {
+            virtual bool isDepthTested() const = 0;
+            virtual void setDepthTested(bool depthTested) = 0;
             // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                addLuaMethod(isDepthTested)
+                addLuaMethod(setDepthTested)
+            }
+        private:
+            LuaGetMethod(DepthTestable, isDepthTested, boolean)
+            template<class T>
+            static int _lua_setDepthTested(lua_State *L) {
+                getUpvalue<T>(L)->setDepthTested(lua_toboolean(L, 1));
+                return 0;
+            }
+        };
 
+        struct MultiPoint3D {
+            virtual int getPointCount() const = 0;
+            virtual Vec3 getPoint(int idx) const = 0;
+            virtual void setPoint(int idx, Vec3 pt) = 0;
+            // MARK: LuaObject
+            template<class T>
+            void toLua(lua_State *L) {
+                addLuaMethod(getPoint)
+                addLuaMethod(setPoint)
+            }
+        private:
+            template<class T>
+            static int _lua_getPoint(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                int idx = luaL_checkinteger(L, 1);
+                if (idx < 1 || idx > obj->getPointCount()) luaL_error(L, "bad argument #1 (index out of range)");
+                Vec3 p = obj->getPoint(idx - 1);
+                lua_pushnumber(L, p.x);
+                lua_pushnumber(L, p.y);
+                lua_pushnumber(L, p.z);
+                return 3;
+            }
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                MultiPoint2D::toLua<T>(L, ptr);
+            static int _lua_setPoint(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                int idx = luaL_checkinteger(L, 1);
+                if (idx < 1 || idx > obj->getPointCount()) luaL_error(L, "bad argument #1 (index out of range)");
+                obj->setPoint(idx - 1, {(float)luaL_checknumber(L, 2), (float)luaL_checknumber(L, 3), (float)luaL_checknumber(L, 4)});
+                return 0;
             }
+        };
 
-            // MARK: MultiPoint2D
+        // Where an object is in its group. The rotation matrix is kept, so it's only computed when the rotation changes.
+        struct Placement {
+            Vec3 position = {0, 0, 0};
+            Vec3 rotation = {0, 0, 0};
+            Transform3D rotationMatrix;
+            bool facesCamera = false;
+
+            void setRotation(Vec3 degrees) {
+                rotation = degrees;
+                rotationMatrix = Transform3D::rotate(degrees);
+                facesCamera = false;
+            }
+            // Returns the view space transform of an object in a group, rotating it around the pivot (in object space).
+            Transform3D place(const Transform3D& parent, Vec3 pivot) const {
+                Transform3D t = parent * Transform3D::translate({position.x + pivot.x, position.y + pivot.y, position.z + pivot.z});
+                if (facesCamera) {
+                    // Keep the position, but line the axes up with the view
+                    for (int i = 0; i < 3; i++)
+                        for (int j = 0; j < 3; j++) t.m[i][j] = i == j;
+                } else t = t * rotationMatrix;
+                return t * Transform3D::translate({-pivot.x, -pivot.y, -pivot.z});
+            }
+        };
 
-            virtual int getPointCount() const override {
+        // Classes
+
+        class Box3D: public LuaObject<Box3D, ColorableObject>, Positionable3D, Rotatable3D, DepthTestable {
+            Placement placement;
+            Vec3 size = {1, 1, 1};
+            bool depthTested = true;
+            template<class T>
+            static int _lua_getSize(lua_State *L) {
+                Vec3 s = getUpvalue<T>(L)->getSize();
+                lua_pushnumber(L, s.x);
+                lua_pushnumber(L, s.y);
+                lua_pushnumber(L, s.z);
                 return 3;
             }
+            template<class T>
+            static int _lua_setSize(lua_State *L) {
+                getUpvalue<T>(L)->setSize({(float)luaL_checknumber(L, 1), (float)luaL_checknumber(L, 2), (float)luaL_checknumber(L, 3)});
+                return 0;
+            }
+        public:
+            Box3D(ObjectGroup * p): LuaObject(p) {}
 
-            virtual SDL_Point getPoint(int idx) const override {
-                return points[idx];
+            Vec3 getSize() const {
+                return size;
             }
 
-            virtual void setPoint(int idx, SDL_Point pt) override {
-                points[idx] = pt;
+            void setSize(Vec3 s) {
+                size = s;
                 setDirty();
             }
-        };
-
-        class Polygon: public ColorableObject, MultiPointResizable2D {
-        protected:
-            std::vector<SDL_Point> points;
-            TPPLPartition part;
-            TPPLPolyList tris;
-            bool pointsDirty = true;
-        public:
-            Polygon(ObjectGroup * p): ColorableObject(p) {}
 
             // MARK: BaseObject
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                if (points.empty()) return;
-                if (pointsDirty) {
-                    TPPLPoly poly;
-                    tris.clear();
-                    poly.Init(points.size());
-                    for (int i = 0; i < points.size(); i++) poly[i] = {(double)points[i].x, (double)points[i].y};
-                    part.Triangulate_EC(&poly, &tris);
-                    pointsDirty = false;
-                }
-                SDL_Vertex * vertices = new SDL_Vertex[tris.size()*3];
-                int i = 0;
-                for (auto it = tris.begin(); it != tris.end(); i++, it++) {
-                    vertices[i*3] = {{(float)(*it)[0].x, (float)(*it)[0].y}, {rgba(color)}, {0, 0}};
-                    vertices[i*3+1] = {{(float)(*it)[1].x, (float)(*it)[1].y}, {rgba(color)}, {0, 0}};
-                    vertices[i*3+2] = {{(float)(*it)[2].x, (float)(*it)[2].y}, {rgba(color)}, {0, 0}};
+            virtual void project(Scene3D& scene, const Transform3D& transform) override {
+                // Corners are numbered by their coordinates: bit 0 is X, bit 1 is Y and bit 2 is Z.
+                // Faces are shaded by direction like Minecraft's blocks, so the edges can be told apart without lighting.
+                static const struct {int corners[4]; float shade;} faces[6] = {
+                    {{0, 2, 6, 4}, 0.6f}, {{1, 3, 7, 5}, 0.6f},
+                    {{0, 1, 5, 4}, 0.5f}, {{2, 3, 7, 6}, 1.0f},
+                    {{0, 1, 3, 2}, 0.8f}, {{4, 5, 7, 6}, 0.8f}
+                };
+                static const SDL_FPoint uv[3] = {{0, 0}, {0, 0}, {0, 0}};
+                const Vec3 half = {size.x / 2, size.y / 2, size.z / 2};
+                const Transform3D m = placement.place(transform, half);
+                const Vec3 center = m.apply(half);
+                if (!scene.visible(center, sqrtf(half.x * half.x + half.y * half.y + half.z * half.z))) return;
+                Vec3 c[8];
+                for (int i = 0; i < 8; i++) c[i] = m.apply({i & 1 ? size.x : 0.0f, i & 2 ? size.y : 0.0f, i & 4 ? size.z : 0.0f});
+                for (const auto& face : faces) {
+                    const Vec3& a = c[face.corners[0]], & b = c[face.corners[1]], & d = c[face.corners[2]], & e = c[face.corners[3]];
+                    // Faces turned away from the camera are hidden by the others
+                    const Vec3 mid = {(a.x + d.x) / 2, (a.y + d.y) / 2, (a.z + d.z) / 2};
+                    if ((mid.x - center.x) * mid.x + (mid.y - center.y) * mid.y + (mid.z - center.z) * mid.z >= 0) continue;
+                    const SDL_Color col = {(Uint8)(((color >> 24) & 0xFF) * face.shade), (Uint8)(((color >> 16) & 0xFF) * face.shade),
+                        (Uint8)(((color >> 8) & 0xFF) * face.shade), (Uint8)(color & 0xFF)};
+                    scene.addTriangle({a, b, d}, uv, col, NULL, !depthTested);
+                    scene.addTriangle({a, d, e}, uv, col, NULL, !depthTested);
                 }
-                SDL_RenderGeometry(ren->ren, NULL, vertices, tris.size()*3, NULL, 0);
-                delete[] vertices;
             }
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                MultiPointResizable2D::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                ColorableObject::toLua<T>(L);
+                Positionable3D::toLua<T>(L);
+                Rotatable3D::toLua<T>(L);
+                DepthTestable::toLua<T>(L);
+                addLuaMethod(getSize)
+                addLuaMethod(setSize)
             }
 
-            // MARK: MultiPoint2D
-
-            virtual int getPointCount() const override {
-                return points.size();
-            }
+            // MARK: Positionable3D
 
-            virtual SDL_Point getPoint(int idx) const override {
-                return points[idx];
+            virtual Vec3 getPosition3D() const override {
+                return placement.position;
             }
 
-            virtual void setPoint(int idx, SDL_Point pt) override {
-                points[idx] = pt;
+            virtual void setPosition3D(Vec3 pos) override {
+                placement.position = pos;
                 setDirty();
-                pointsDirty = true;
             }
 
-            // MARK: MultiPointResizable2D
+            // MARK: Rotatable3D
 
-            virtual void insertPoint(int x, int y, int idx = INT_MAX) override {
-                if (idx >= points.size()) points.push_back({x, y});
-                else points.insert(points.begin() + idx, {x, y});
-                setDirty();
-                pointsDirty = true;
+            virtual bool hasRotation() const override {
+                return !placement.facesCamera;
             }
 
-            virtual void removePoint(int idx) override {
-                points.erase(points.begin() + idx);
-                setDirty();
-                pointsDirty = true;
+            virtual Vec3 getRotation() const override {
+                return placement.rotation;
             }
 
-        };
-
-        // TODO: fix thickness
-        class LineLoop: public Polygon, Scalable {
-            double scale = 1.0;
-        public:
-            LineLoop(ObjectGroup * p): Polygon(p) {}
-
-            // MARK: BaseObject
-
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                if (points.size() > 2) {
-                    for (int i = 0; i < points.size() - 1; i++) {
-                        thickLineColor_ren(ren->ren, transform.x + points[i].x, transform.y + points[i].y, transform.x + points[i+1].x, transform.y + points[i+1].y, scale, color);
-                    }
-                }
-                if (points.size() > 1) thickLineColor_ren(ren->ren, transform.x + points.back().x, transform.y + points.back().y, transform.x + points.front().x, transform.y + points.front().y, scale, color);
+            virtual void setRotation(Vec3 degrees) override {
+                placement.setRotation(degrees);
+                setDirty();
             }
 
-            // MARK: LuaObject
-
-            template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                Polygon::toLua<T>(L, ptr);
-                Scalable::toLua<T>(L, ptr);
+            virtual void clearRotation() override {
+                placement.facesCamera = true;
+                setDirty();
             }
 
-            // MARK: Scalable
+            // MARK: DepthTestable
 
-            virtual double getScale() const override {
-                return scale;
+            virtual bool isDepthTested() const override {
+                return depthTested;
             }
 
-            virtual void setScale(double s) override {
-                scale = s;
+            virtual void setDepthTested(bool d) override {
+                depthTested = d;
+                setDirty();
             }
-
         };
 
-        class Text: public ColorableObject, Positionable2D, Scalable, TextObject {
-            SDL_Point position = {0, 0};
-            double scale = 1.0;
-            std::string text;
-            bool shadow = false;
-            int lineHeight = 0;
-            SDL_Texture * texture = NULL;
+        class Line3D: public LuaObject<Line3D, ColorableObject>, MultiPoint3D, Scalable, DepthTestable {
+            Vec3 points[2] = {{0, 0, 0}, {0, 0, 0}};
+            double thickness = 1.0;
+            bool depthTested = true;
         public:
-            Text(ObjectGroup * p): ColorableObject(p) {}
-            ~Text() {if (texture) SDL_DestroyTexture(texture);}
+            Line3D(ObjectGroup * p): LuaObject(p) {}
 
             // MARK: BaseObject
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                SDL_RWops * rw = SDL_RWFromConstMem(font_ttf, font_ttf_len);
-                TTF_Font * font = TTF_OpenFontRW(rw, true, scale);
-                std::vector<std::string> lines = split(text);
-                int sw = 0, sh = 0;
-                for (int i = 0; i < lines.size(); i++) {
-                    int w = 0;
-                    TTF_SizeText(font, lines[i].c_str(), &w, &sh);
-                    if (w > sw) sw = w;
-                }
-                sh += lineHeight * (lines.size() - 1);
-                SDL_Surface * surf = SDL_CreateRGBSurfaceWithFormat(0, sw, sh, 32, SDL_PIXELFORMAT_RGBA32);
-                for (int i = 0; i < lines.size(); i++) {
-                    SDL_Surface * s = TTF_RenderText_Solid(font, lines[i].c_str(), {rgba(color)});
-                    SDL_Rect rect = {0, i * lineHeight, s->w, s->h};
-                    SDL_BlitSurface(s, NULL, surf, &rect);
-                    SDL_FreeSurface(s);
-                }
-                TTF_CloseFont(font);
-                if (texture) SDL_DestroyTexture(texture);
-                texture = SDL_CreateTextureFromSurface(ren->ren, surf);
-                SDL_Rect rect = {transform.x + position.x, transform.y + position.y, surf->w, surf->h};
-                SDL_FreeSurface(surf);
-                SDL_RenderCopy(ren->ren, texture, NULL, &rect);
+            virtual void project(Scene3D& scene, const Transform3D& transform) override {
+                const Vec3 a = transform.apply(points[0]), b = transform.apply(points[1]);
+                const Vec3 d = {(b.x - a.x) / 2, (b.y - a.y) / 2, (b.z - a.z) / 2};
+                if (!scene.visible({a.x + d.x, a.y + d.y, a.z + d.z}, sqrtf(d.x * d.x + d.y * d.y + d.z * d.z))) return;
+                scene.addLine(a, b, thickness, {rgba(color)}, !depthTested);
             }
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ColorableObject::toLua<T>(L, ptr);
-                Positionable2D::toLua<T>(L, ptr);
-                Scalable::toLua<T>(L, ptr);
-                TextObject::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                ColorableObject::toLua<T>(L);
+                MultiPoint3D::toLua<T>(L);
+                Scalable::toLua<T>(L);
+                DepthTestable::toLua<T>(L);
             }
 
-            // MARK: Positionable2D
+            // MARK: MultiPoint3D
 
-            virtual SDL_Point getPosition() const override {
-                return position;
+            virtual int getPointCount() const override {
+                return 2;
             }
 
-            virtual void setPosition(SDL_Point pos) override {
-                position = pos;
+            virtual Vec3 getPoint(int idx) const override {
+                return points[idx];
+            }
+
+            virtual void setPoint(int idx, Vec3 pt) override {
+                points[idx] = pt;
                 setDirty();
             }
 
             // MARK: Scalable
 
             virtual double getScale() const override {
-                return scale;
+                return thickness;
             }
 
-            virtual void setScale(double s) override {
-                scale = s;
+            virtual void setScale(double scale) override {
+                thickness = scale;
                 setDirty();
             }
-        
-            // MARK: TextObject
-
-            virtual int getLineHeight() const override {
-                return lineHeight;
-            }
-
-            virtual const char * getText() const override {
-                return text.c_str();
-            }
-
-            virtual bool hasShadow() const override {
-                return shadow;
-            }
 
-            virtual void setLineHeight(int height) override {
-                lineHeight = height;
-                setDirty();
-            }
+            // MARK: DepthTestable
 
-            virtual void setShadow(bool s) override {
-                shadow = s;
-                setDirty();
+            virtual bool isDepthTested() const override {
+                return depthTested;
             }
 
-            virtual void setText(const char * t) override {
-                text = t;
+            virtual void setDepthTested(bool d) override {
+                depthTested = d;
                 setDirty();
             }
-
         };
 
-        class ObjectGroup2D;
+        class ObjectFrame;
+        class ObjectGroup3D;
 
         // Interface (but this needs to be below the rest)
-        struct Group2D: public ObjectGroup {
-            virtual Dot * addDot(SDL_Point pos, unsigned int color = Colorable::DEFAULT_COLOR, int size = 1) = 0;
-            virtual ObjectGroup2D * addGroup(SDL_Point pos) = 0;
-            virtual Line * addLine(SDL_Point start, SDL_Point end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) = 0;
-            virtual LineLoop * addLines(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) = 0;
-            virtual Polygon * addPolygon(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
-            virtual Rectangle * addRectangle(int x, int y, int width, int height, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
-            virtual Text * addText(SDL_Point pos, const std::string& contents, unsigned int color = Colorable::DEFAULT_COLOR, double size = 1.0) = 0;
-            virtual Triangle * addTriangle(SDL_Point p1, SDL_Point p2, SDL_Point p3, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
+        struct Group3D: public ObjectGroup {
+            virtual Box3D * addBox(Vec3 pos, Vec3 size, unsigned int color = Colorable::DEFAULT_COLOR) = 0;
+            virtual ObjectFrame * addFrame(Vec3 pos) = 0;
+            virtual Line3D * addLine(Vec3 start, Vec3 end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) = 0;
             // MARK: LuaObject
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ObjectGroup::toLua<T>(L, ptr);
-                addLuaMethod(addDot)
-                addLuaMethod(addGroup)
+            void toLua(lua_State *L) {
+                ObjectGroup::toLua<T>(L);
+                addLuaMethod(addBox)
+                addLuaMethod(addFrame)
                 addLuaMethod(addLine)
-                addLuaMethod(addLines)
-                addLuaMethod(addPolygon)
-                addLuaMethod(addRectangle)
-                addLuaMethod(addText)
-                addLuaMethod(addTriangle)
             }
         private:
+            // Like in 2D groups, objects are added under the renderer's lock, once the arguments have been read.
             template<class T>
-            static int _lua_addDot(lua_State *L) {
-                Dot * obj = getUpvalue<T>(L)->addDot(luaL_checkpoint(L, 1), luaL_optinteger(L, 2, 0xFFFFFFFF), luaL_optinteger(L, 3, 1));
-                obj->toLua<Dot>(L, savePointer(L, obj));
-                return 1;
-            }
-            template<class T>
-            static int _lua_addGroup(lua_State *L);
-            template<class T>
-            static int _lua_addLine(lua_State *L) {
-                Line * obj = getUpvalue<T>(L)->addLine(luaL_checkpoint(L, 1), luaL_checkpoint(L, 2), luaL_optinteger(L, 3, 0xFFFFFFFF), luaL_optnumber(L, 4, 1.0));
-                obj->toLua<Line>(L, savePointer(L, obj));
-                return 1;
-            }
-            template<class T>
-            static int _lua_addLines(lua_State *L) {
-                std::vector<SDL_Point> points;
-                luaL_checktype(L, 1, LUA_TTABLE);
-                lua_rawgeti(L, 1, 1);
-                for (int i = 1; !lua_isnil(L, -1); i++) {
-                    points.push_back(luaL_checkpoint(L, -1));
-                    lua_pop(L, 1);
-                    lua_rawgeti(L, 1, i+1);
-                }
-                lua_pop(L, 1);
-                LineLoop * obj = getUpvalue<T>(L)->addLines(points, luaL_optinteger(L, 2, 0xFFFFFFFF), luaL_optnumber(L, 3, 1.0));
-                obj->toLua<LineLoop>(L, savePointer(L, obj));
-                return 1;
-            }
-            template<class T>
-            static int _lua_addPolygon(lua_State *L) {
-                std::vector<SDL_Point> points;
-                luaL_checktype(L, 1, LUA_TTABLE);
-                lua_rawgeti(L, 1, 1);
-                for (int i = 1; !lua_isnil(L, -1); i++) {
-                    points.push_back(luaL_checkpoint(L, -1));
-                    lua_pop(L, 1);
-                    lua_rawgeti(L, 1, i+1);
+            static int _lua_addBox(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const Vec3 pos = {(float)luaL_checknumber(L, 1), (float)luaL_checknumber(L, 2), (float)luaL_checknumber(L, 3)};
+                Vec3 size = {1, 1, 1};
+                unsigned int color;
+                // The size can be left out, like in Plethora
+                if (lua_gettop(L) >= 6) {
+                    size = {(float)luaL_checknumber(L, 4), (float)luaL_checknumber(L, 5), (float)luaL_checknumber(L, 6)};
+                    color = luaL_optinteger(L, 7, 0xFFFFFFFF);
+                } else color = luaL_optinteger(L, 4, 0xFFFFFFFF);
+                Box3D * obj;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    obj = group->addBox(pos, size, color);
                 }
-                lua_pop(L, 1);
-                Polygon * obj = getUpvalue<T>(L)->addPolygon(points, luaL_optinteger(L, 2, 0xFFFFFFFF));
-                obj->toLua<Polygon>(L, savePointer(L, obj));
-                return 1;
-            }
-            template<class T>
-            static int _lua_addRectangle(lua_State *L) {
-                Rectangle * obj = getUpvalue<T>(L)->addRectangle(luaL_checkinteger(L, 1), luaL_checkinteger(L, 2), luaL_checkinteger(L, 3), luaL_checkinteger(L, 4), luaL_optinteger(L, 5, 0xFFFFFFFF));
-                obj->toLua<Rectangle>(L, savePointer(L, obj));
+                pushObject(L, obj);
                 return 1;
             }
             template<class T>
-            static int _lua_addText(lua_State *L) {
-                Text * obj = getUpvalue<T>(L)->addText(luaL_checkpoint(L, 1), luaL_checkstring(L, 2), luaL_optinteger(L, 3, 0xFFFFFFFF), luaL_optnumber(L, 4, 1.0));
-                obj->toLua<Text>(L, savePointer(L, obj));
-                return 1;
-            }
+            static int _lua_addFrame(lua_State *L);
             template<class T>
-            static int _lua_addTriangle(lua_State *L) {
-                Triangle * obj = getUpvalue<T>(L)->addTriangle(luaL_checkpoint(L, 1), luaL_checkpoint(L, 2), luaL_checkpoint(L, 3), luaL_optinteger(L, 4, 0xFFFFFFFF));
-                obj->toLua<Triangle>(L, savePointer(L, obj));
+            static int _lua_addLine(lua_State *L) {
+                T * group = getUpvalue<T>(L);
+                const Vec3 start = luaL_checkpoint3d(L, 1), end = luaL_checkpoint3d(L, 2);
+                const unsigned int color = luaL_optinteger(L, 3, 0xFFFFFFFF);
+                const double thickness = luaL_optnumber(L, 4, 1.0);
+                Line3D * obj;
+                {
+                    std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+                    obj = group->addLine(start, end, color, thickness);
+                }
+                pushObject(L, obj);
                 return 1;
             }
         };
 
-        class ObjectGroup2D: public BaseObject, Group2D, Positionable2D {
-            SDL_Point position = {0, 0};
+        class ObjectGroup3D: public LuaObject<ObjectGroup3D, BaseObject>, Group3D, Positionable3D, Rotatable3D {
+            Placement placement;
         public:
-            ObjectGroup2D(ObjectGroup * p): BaseObject(p) {}
+            ObjectGroup3D(ObjectGroup * p): LuaObject(p) {renderer = p->renderer;}
 
             // MARK: BaseObject
 
-            virtual void draw(GlassesRenderer * ren, SDL_Point transform) override {
-                transform.x += position.x;
-                transform.y += position.y;
-                for (BaseObject * obj : children) obj->draw(ren, transform);
+            virtual void project(Scene3D& scene, const Transform3D& transform) override {
+                const Transform3D t = placement.place(transform, {0, 0, 0});
+                for (BaseObject * obj : children) obj->project(scene, t);
             }
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                BaseObject::toLua<T>(L, ptr);
-                Group2D::toLua<T>(L, ptr);
-                Positionable2D::toLua<T>(L, ptr);
+            void toLua(lua_State *L) {
+                BaseObject::toLua<T>(L);
+                Group3D::toLua<T>(L);
+                Positionable3D::toLua<T>(L);
+                Rotatable3D::toLua<T>(L);
             }
 
             // MARK: ObjectGroup
@@ -1032,29 +3348,25 @@ namespace objects {
                 BaseObject::setDirty();
             }
 
-            // MARK: Group2D
+            // The 3D canvas is always redrawn as a whole
+            virtual void invalidate(const SDL_Rect& rect) override {}
 
-            virtual Dot * addDot(SDL_Point pos, unsigned int color = Colorable::DEFAULT_COLOR, int size = 1) override {
-                Dot * retval = new Dot(this);
-                printf("%p\n", retval);
-                retval->setPosition(pos);
+            // MARK: Group3D
+
+            virtual Box3D * addBox(Vec3 pos, Vec3 size, unsigned int color = Colorable::DEFAULT_COLOR) override {
+                Box3D * retval = new Box3D(this);
+                retval->setPosition3D(pos);
+                retval->setSize(size);
                 retval->setColor(color);
-                retval->setScale(size);
                 children.push_back(retval);
                 setDirty();
                 return retval;
             }
 
-            virtual ObjectGroup2D * addGroup(SDL_Point pos) override {
-                ObjectGroup2D * retval = new ObjectGroup2D(this);
-                retval->setPosition(pos);
-                children.push_back(retval);
-                setDirty();
-                return retval;
-            }
+            virtual ObjectFrame * addFrame(Vec3 pos) override;
 
-            virtual Line * addLine(SDL_Point start, SDL_Point end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) override {
-                Line * retval = new Line(this);
+            virtual Line3D * addLine(Vec3 start, Vec3 end, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) override {
+                Line3D * retval = new Line3D(this);
                 retval->setPoint(0, start);
                 retval->setPoint(1, end);
                 retval->setColor(color);
@@ -1064,103 +3376,309 @@ namespace objects {
                 return retval;
             }
 
-            virtual LineLoop * addLines(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR, double thickness = 1.0) override {
-                LineLoop * retval = new LineLoop(this);
-                for (SDL_Point p : points) retval->insertPoint(p.x, p.y);
-                retval->setScale(thickness);
-                retval->setColor(color);
-                children.push_back(retval);
-                setDirty();
-                return retval;
+            // MARK: Positionable3D
+
+            virtual Vec3 getPosition3D() const override {
+                return placement.position;
             }
 
-            virtual Polygon * addPolygon(const std::vector<SDL_Point>& points, unsigned int color = Colorable::DEFAULT_COLOR) override {
-                Polygon * retval = new Polygon(this);
-                for (SDL_Point p : points) retval->insertPoint(p.x, p.y);
-                retval->setColor(color);
-                children.push_back(retval);
+            virtual void setPosition3D(Vec3 pos) override {
+                placement.position = pos;
                 setDirty();
-                return retval;
             }
 
-            virtual Rectangle * addRectangle(int x, int y, int width, int height, unsigned int color = Colorable::DEFAULT_COLOR) override {
-                Rectangle * retval = new Rectangle(this);
-                retval->setPosition({x, y});
-                retval->setSize({width, height});
-                retval->setColor(color);
-                children.push_back(retval);
+            // MARK: Rotatable3D
+
+            virtual bool hasRotation() const override {
+                return !placement.facesCamera;
+            }
+
+            virtual Vec3 getRotation() const override {
+                return placement.rotation;
+            }
+
+            virtual void setRotation(Vec3 degrees) override {
+                placement.setRotation(degrees);
                 setDirty();
-                return retval;
             }
 
-            virtual Text * addText(SDL_Point pos, const std::string& contents, unsigned int color = Colorable::DEFAULT_COLOR, double size = 1.0) override {
-                Text * retval = new Text(this);
-                retval->setPosition(pos);
-                retval->setText(contents.c_str());
-                retval->setColor(color);
-                retval->setScale(size);
-                children.push_back(retval);
+            virtual void clearRotation() override {
+                placement.facesCamera = true;
                 setDirty();
-                return retval;
             }
+        };
 
-            virtual Triangle * addTriangle(SDL_Point p1, SDL_Point p2, SDL_Point p3, unsigned int color = Colorable::DEFAULT_COLOR) override {
-                Triangle * retval = new Triangle(this);
-                retval->setPoint(0, p1);
-                retval->setPoint(1, p2);
-                retval->setPoint(2, p3);
-                retval->setColor(color);
-                children.push_back(retval);
+        // A 2D canvas placed in the 3D canvas. Its objects are drawn into a texture, which is mapped onto a square.
+        class ObjectFrame: public LuaObject<ObjectFrame, object2d::Frame2D>, Positionable3D, Rotatable3D, DepthTestable {
+            Placement placement;
+            bool depthTested = true;
+            SDL_Texture * canvasTexture = NULL;
+        public:
+            static constexpr int SIZE = 256; // in pixels
+            static constexpr float SCALE = 1.0f / 64.0f; // blocks per pixel
+
+            ObjectFrame(objects::ObjectGroup * p): LuaObject({SIZE, SIZE}, p->renderer) {parent = p;}
+            ~ObjectFrame() {
+                if (canvasTexture) getRenderer()->releaseTexture(canvasTexture);
+            }
+
+            // MARK: BaseObject
+
+            virtual void remove() override {
+                BaseObject::remove();
+            }
+
+            virtual void setDirty() override {
+                Frame2D::setDirty();
+                parent->setDirty();
+            }
+
+            virtual void project(Scene3D& scene, const Transform3D& transform) override {
+                static const SDL_FPoint uv1[3] = {{0, 0}, {1, 0}, {1, 1}}, uv2[3] = {{0, 0}, {1, 1}, {0, 1}};
+                const float size = SIZE * SCALE;
+                const Vec3 pivot = {size / 2, -size / 2, 0};
+                const Transform3D m = placement.place(transform, pivot);
+                if (!scene.visible(m.apply(pivot), size * 0.70710678f)) return;
+                scene.ren->renderFrame(this, canvasTexture);
+                if (canvasTexture == NULL) return;
+                // 2D coordinates grow downwards
+                const Vec3 c[4] = {m.apply({0, 0, 0}), m.apply({size, 0, 0}), m.apply({size, -size, 0}), m.apply({0, -size, 0})};
+                scene.addTriangle({c[0], c[1], c[2]}, uv1, {0xFF, 0xFF, 0xFF, 0xFF}, canvasTexture, !depthTested);
+                scene.addTriangle({c[0], c[2], c[3]}, uv2, {0xFF, 0xFF, 0xFF, 0xFF}, canvasTexture, !depthTested);
+            }
+
+            // MARK: LuaObject
+
+            template<class T>
+            void toLua(lua_State *L) {
+                groupToLua<T>(L);
+                Positionable3D::toLua<T>(L);
+                Rotatable3D::toLua<T>(L);
+                DepthTestable::toLua<T>(L);
+            }
+
+            // MARK: Positionable3D
+
+            virtual Vec3 getPosition3D() const override {
+                return placement.position;
+            }
+
+            virtual void setPosition3D(Vec3 pos) override {
+                placement.position = pos;
                 setDirty();
-                return retval;
             }
 
-            // MARK: Positionable2D
+            // MARK: Rotatable3D
 
-            virtual SDL_Point getPosition() const override {
-                return position;
+            virtual bool hasRotation() const override {
+                return !placement.facesCamera;
             }
 
-            virtual void setPosition(SDL_Point pos) override {
-                position = pos;
+            virtual Vec3 getRotation() const override {
+                return placement.rotation;
+            }
+
+            virtual void setRotation(Vec3 degrees) override {
+                placement.setRotation(degrees);
                 setDirty();
             }
 
+            virtual void clearRotation() override {
+                placement.facesCamera = true;
+                setDirty();
+            }
+
+            // MARK: DepthTestable
+
+            virtual bool isDepthTested() const override {
+                return depthTested;
+            }
+
+            virtual void setDepthTested(bool d) override {
+                depthTested = d;
+                setDirty();
+            }
         };
 
-        class Frame2D: public ObjectGroup2D {
-            SDL_Point size;
+        // The root of the 3D canvas, with the camera it's seen through. Like in Plethora, objects are added to the groups it creates.
+        class Canvas3D: public LuaObject<Canvas3D, BaseObject>, ObjectGroup {
+            float yaw = 180.0f, pitch = 0.0f, fov = 70.0f; // facing north, so X goes to the right
             template<class T>
-            static int _lua_getSize(lua_State *L) {
-                SDL_Point p = getUpvalue<T>(L)->getSize();
-                lua_pushinteger(L, p.x);
-                lua_pushinteger(L, p.y);
-                return 2;
+            static int _lua_create(lua_State *L) {
+                T * canvas = getUpvalue<T>(L);
+                const Vec3 offset = lua_isnoneornil(L, 1) ? Vec3 {0, 0, 0} : luaL_checkpoint3d(L, 1);
+                ObjectGroup3D * obj;
+                {
+                    std::lock_guard<std::mutex> lock(canvas->renderer->renderlock);
+                    obj = canvas->create(offset);
+                }
+                pushObject(L, obj);
+                return 1;
+            }
+            template<class T>
+            static int _lua_getCamera(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                lua_pushnumber(L, obj->yaw);
+                lua_pushnumber(L, obj->pitch);
+                lua_pushnumber(L, obj->fov);
+                return 3;
+            }
+            template<class T>
+            static int _lua_setCamera(lua_State *L) {
+                T * obj = getUpvalue<T>(L);
+                const float yaw = luaL_checknumber(L, 1), pitch = luaL_checknumber(L, 2), fov = luaL_optnumber(L, 3, obj->fov);
+                if (pitch < -90.0f || pitch > 90.0f) luaL_error(L, "bad argument #2 (value out of range)");
+                if (fov < 1.0f || fov > 179.0f) luaL_error(L, "bad argument #3 (value out of range)");
+                obj->setCamera(yaw, pitch, fov);
+                return 0;
             }
         public:
-            bool isDirty = true;
-            Frame2D(SDL_Point sz): ObjectGroup2D(nullptr), size(sz) {setPosition({0, 0});}
-            SDL_Point getSize() const {return size;}
+            std::atomic<bool> isDirty;
+            Canvas3D(GlassesRenderer * r): LuaObject(nullptr), isDirty(false) {renderer = r;}
+            ~Canvas3D() {
+                releaseHandle();
+            }
+
+            ObjectGroup3D * create(Vec3 offset) {
+                ObjectGroup3D * retval = new ObjectGroup3D(this);
+                retval->setPosition3D(offset);
+                children.push_back(retval);
+                setDirty();
+                return retval;
+            }
+
+            void setCamera(float y, float p, float f) {
+                yaw = y;
+                pitch = p;
+                fov = f;
+                setDirty();
+            }
+
+            // Projects the whole canvas, replacing the scene.
+            void buildScene(Scene3D& scene) {
+                scene.begin(renderer, yaw, pitch, fov);
+                for (BaseObject * obj : children) obj->project(scene, scene.view);
+                scene.finish();
+            }
 
             // MARK: BaseObject
 
             virtual void remove() override {}
-            virtual void setDirty() override {isDirty = true;}
+
+            virtual HandleTable * getHandleTable() const override {
+                return renderer->handles;
+            }
+
+            virtual GlassesRenderer * getRenderer() const override {
+                return renderer;
+            }
 
             // MARK: LuaObject
 
             template<class T>
-            void toLua(lua_State *L, void* ptr) {
-                ObjectGroup2D::toLua<T>(L, ptr);
-                addLuaMethod(getSize)
+            void toLua(lua_State *L) {
+                lua_newtable(L);
+                ObjectGroup::toLua<T>(L);
+                addLuaMethod(create)
+                addLuaMethod(getCamera)
+                addLuaMethod(setCamera)
+            }
+
+            // MARK: ObjectGroup
+
+            virtual void clear() override {
+                while (!children.empty()) children.front()->remove();
+                setDirty();
+            }
+
+            virtual void setDirty() override {
+                isDirty = true;
+                wakeRenderLoop();
             }
+
+            virtual void invalidate(const SDL_Rect& rect) override {}
         };
 
     };
 
 };
 
-void objects::BaseObject::setDirty() {parent->setDirty();}
+objects::BaseObject::~BaseObject() {
+    if (handle != HandleTable::NONE) parent->renderer->handles->release(handle);
+}
+// The handle table belongs to the computer, so it outlives the Lua states that collect the handles.
+static int handleGC(lua_State *L) {
+    const LuaHandle * handle = (const LuaHandle*)lua_touserdata(L, 1);
+    objects::BaseObject * obj = handle->table->get(handle->slot, handle->generation);
+    if (obj && obj->releaseLuaHandle() != 1) return 0;
+    // Once the object is gone, or only the copy its methods are bound to is left, the methods are dropped from
+    // the caches of the type. Methods a script kept still hold the copy until they are collected.
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__index");
+    lua_getupvalue(L, -1, 3);
+    lua_rawgeti(L, -1, handle->slot);
+    if (lua_isnil(L, -1) || ((const LuaHandle*)lua_touserdata(L, -1))->generation != handle->generation) {
+        lua_pop(L, 4);
+        return 0;
+    }
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, handle->slot);
+    lua_pop(L, 1);
+    lua_getupvalue(L, -1, 2);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_rawgeti(L, -1, handle->slot);
+        if (!lua_isnil(L, -1)) {
+            lua_getupvalue(L, -1, 1);
+            if (((const LuaHandle*)lua_touserdata(L, -1))->generation == handle->generation) {
+                lua_pushnil(L);
+                lua_rawseti(L, -4, handle->slot);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 3);
+    return 0;
+}
+static void retainHandle(const LuaHandle * handle) {
+    objects::BaseObject * obj = handle->table->get(handle->slot, handle->generation);
+    if (obj) obj->retainLuaHandle();
+}
+HandleTable * objects::BaseObject::getHandleTable() const {
+    return parent->renderer->handles;
+}
+GlassesRenderer * objects::BaseObject::getRenderer() const {
+    return parent->renderer;
+}
+void objects::BaseObject::setDirty() {
+    geometryDirty = true;
+    parent->setDirty();
+}
+void objects::BaseObject::update(GlassesRenderer * ren, const Transform2D& transform) {
+    if (!geometryDirty && transform == cachedTransform) return;
+    ren->dirtyObjects.push_back(std::make_pair(this, transform));
+}
+void objects::BaseObject::rebuild(GlassesRenderer * ren, const Transform2D& transform) {
+    parent->invalidate(bounds);
+    vertices.clear();
+    if (transform.isTranslation()) buildGeometry(ren, {(int)transform.x, (int)transform.y});
+    else {
+        // Rotated or scaled groups: build around the origin of the group, then transform the vertices.
+        buildGeometry(ren, {0, 0});
+        for (SDL_Vertex& v : vertices) v.position = transform.apply(v.position);
+    }
+    bounds = vertexBounds(vertices);
+    parent->invalidate(bounds);
+    cachedTransform = transform;
+    geometryDirty = false;
+}
+void objects::BaseObject::draw(GlassesRenderer * ren, const SDL_Rect& clip) {
+    if (vertices.empty() || !intersects(bounds, clip)) return;
+    std::vector<SDL_Vertex>& batch = ren->batch.get(texture);
+    batch.insert(batch.end(), vertices.begin(), vertices.end());
+}
 void objects::BaseObject::remove() {
     for (auto it = parent->children.begin(); it != parent->children.end(); it++) {
         if (*it == this) {
@@ -1168,19 +3686,284 @@ void objects::BaseObject::remove() {
             if (it == parent->children.end()) break;
         }
     }
+    parent->invalidate(getBounds());
     parent->setDirty();
     delete this;
 }
 template<class T>
 int objects::object2d::Group2D::_lua_addGroup(lua_State *L) {
-    ObjectGroup2D * obj = getUpvalue<T>(L)->addGroup(luaL_checkpoint(L, 1));
-    obj->toLua<ObjectGroup2D>(L, savePointer(L, obj));
+    T * group = getUpvalue<T>(L);
+    const SDL_Point pos = luaL_checkpoint(L, 1);
+    ObjectGroup2D * obj;
+    {
+        std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+        obj = group->addGroup(pos);
+    }
+    pushObject(L, obj);
+    return 1;
+}
+objects::object3d::ObjectFrame * objects::object3d::ObjectGroup3D::addFrame(Vec3 pos) {
+    ObjectFrame * retval = new ObjectFrame(this);
+    retval->setPosition3D(pos);
+    children.push_back(retval);
+    setDirty();
+    return retval;
+}
+template<class T>
+int objects::object3d::Group3D::_lua_addFrame(lua_State *L) {
+    T * group = getUpvalue<T>(L);
+    const Vec3 pos = luaL_checkpoint3d(L, 1);
+    ObjectFrame * obj;
+    {
+        std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+        obj = group->addFrame(pos);
+    }
+    pushObject(L, obj);
+    return 1;
+}
+size_t objects::object2d::ObjectGroup2D::build(const SceneBatch& batch, size_t i, size_t count, std::vector<ObjectRef>& created) {
+    const ObjectRef none = {NULL, HandleTable::NONE};
+    for (; count; count--) {
+        const ObjectDesc& desc = batch.objects[i++];
+        ObjectRef ref = none;
+        switch (desc.type) {
+        case 'd': ref = addPrimitive(PrimitiveLayer::DotKind, desc.points[0], {0, 0}, {0, 0}, desc.color, desc.size); break;
+        case 'l': ref = addPrimitive(PrimitiveLayer::LineKind, desc.points[0], desc.points[1], {0, 0}, desc.color, desc.size); break;
+        case 'L': case 'p': {
+            Polygon * obj = desc.type == 'L' ? addLines({}, desc.color, desc.size) : addPolygon({}, desc.color);
+            obj->setPoints(batch.points.data() + desc.first, desc.count);
+            ref.obj = obj;
+            break;
+        }
+        case 'r': ref = addPrimitive(PrimitiveLayer::RectangleKind, desc.points[0], desc.points[1], {0, 0}, desc.color, 1.0f); break;
+        case 'T': ref.obj = addText(desc.points[0], batch.text.substr(desc.first, desc.count), desc.color, desc.size); break;
+        case 't': ref = addPrimitive(PrimitiveLayer::TriangleKind, desc.points[0], desc.points[1], desc.points[2], desc.color, 1.0f); break;
+        case 'g': {
+            ObjectGroup2D * group = addGroup(desc.points[0]);
+            created.push_back({group, HandleTable::NONE});
+            i = group->build(batch, i, desc.count, created);
+            continue;
+        }}
+        created.push_back(ref);
+    }
+    return i;
+}
+
+objects::object2d::PrimitiveLayer::~PrimitiveLayer() {
+    for (Primitive2D * facade : facades) delete facade;
+}
+objects::object2d::Primitive2D * objects::object2d::PrimitiveLayer::getFacade(uint32_t id, uint32_t gen) {
+    if (id >= entryGeneration.size() || entryGeneration[id] != gen) return NULL;
+    if (facades[id]) return facades[id];
+    switch (kinds[entryIndex[id]]) {
+    case DotKind: facades[id] = new Dot(parent, this, id); break;
+    case LineKind: facades[id] = new Line(parent, this, id); break;
+    case RectangleKind: facades[id] = new Rectangle(parent, this, id); break;
+    case TriangleKind: facades[id] = new Triangle(parent, this, id); break;
+    case Removed: break;
+    }
+    return facades[id];
+}
+void objects::object2d::PrimitiveLayer::dropFacade(uint32_t id) {
+    delete facades[id];
+    facades[id] = NULL;
+}
+void objects::object2d::PrimitiveLayer::erase(uint32_t id) {
+    dropFacade(id);
+    const size_t i = entryIndex[id];
+    kinds[i] = Removed;
+    removed++;
+    entryGeneration[id]++;
+    entryIndex[id] = freeIds;
+    freeIds = id;
+    if (removed == kinds.size()) {
+        remove(); // deletes the layer
+        return;
+    }
+    // Removed entries keep an empty span, and are squeezed out once they make up most of the layer.
+    if (removed > 64 && removed * 2 > kinds.size()) {
+        compact();
+        setDirty();
+    } else entryChanged(i);
+}
+void objects::object2d::PrimitiveLayer::writeEntry(size_t i, const Transform2D& transform) {
+    // Rotated or scaled groups: build around the origin of the group, then transform the vertices.
+    const bool translation = transform.isTranslation();
+    const SDL_Point t = translation ? SDL_Point {(int)transform.x, (int)transform.y} : SDL_Point {0, 0};
+    const SDL_Point a = {t.x + p1[i].x, t.y + p1[i].y};
+    scratch.clear();
+    switch (kinds[i]) {
+    case DotKind:
+        pushDot(scratch, a, sizes[i], colors[i]);
+        break;
+    case LineKind:
+        pushThickLine(scratch, a.x, a.y, t.x + p2[i].x, t.y + p2[i].y, sizes[i], colors[i]);
+        break;
+    case RectangleKind:
+        pushRectOutline(scratch, a, p2[i], colors[i]);
+        break;
+    case TriangleKind:
+        pushTriangle(scratch, {(float)a.x, (float)a.y}, {(float)(t.x + p2[i].x), (float)(t.y + p2[i].y)},
+            {(float)(t.x + p3[i].x), (float)(t.y + p3[i].y)}, {rgba(colors[i])});
+        break;
+    case Removed: break;
+    }
+    if (!translation) for (SDL_Vertex& v : scratch) v.position = transform.apply(v.position);
+    entryBounds[i] = vertexBounds(scratch);
+    // The rest of the span repeats the last vertex, which makes triangles without any area.
+    const SDL_Vertex pad = scratch.empty() ? SDL_Vertex {{0, 0}, {0, 0, 0, 0}, {0, 0}} : scratch.back();
+    SDL_Vertex * v = vertices.data() + firstVertex[i];
+    for (size_t k = 0; k < spans[i]; k++) v[k] = k < scratch.size() ? scratch[k] : pad;
+}
+void objects::object2d::PrimitiveLayer::rebuild(GlassesRenderer * ren, const Transform2D& transform) {
+    // The most vertices each kind of entry can have: a quad for dots and lines, four for rectangle outlines.
+    static const Uint8 maxVertices[] = {0, 6, 6, 24, 3};
+    {
+        std::lock_guard<std::mutex> lock(changedLock);
+        patching.swap(changed);
+    }
+    const size_t count = kinds.size();
+    firstVertex.resize(count);
+    spans.resize(count);
+    entryBounds.resize(count);
+    size_t first = vertices.size();
+    if (rebuildAll || !(transform == cachedTransform) || patching.size() * 2 > count) {
+        // Lays out every span again, dropping those of removed entries.
+        parent->invalidate(bounds);
+        patching.clear();
+        first = 0;
+        built = 0;
+        bounds = {0, 0, 0, 0};
+    }
+    // Past this many areas the frame merges them into their bounding box anyway, so they're merged here instead.
+    const bool merge = patching.size() * 2 + count - built > objects::object2d::Frame2D::MAX_DAMAGE_RECTS;
+    SDL_Rect damage = {0, 0, 0, 0};
+    auto invalidate = [this, merge, &damage](const SDL_Rect& rect) {
+        if (merge) damage = unionRect(damage, rect);
+        else parent->invalidate(rect);
+    };
+    for (size_t i : patching) {
+        if (i >= built) continue; // added since, so it gets its span below
+        invalidate(entryBounds[i]);
+        writeEntry(i, transform);
+        invalidate(entryBounds[i]);
+        // The bounds only grow until the next full layout; they're only used to skip drawing.
+        bounds = unionRect(bounds, entryBounds[i]);
+    }
+    for (size_t i = built; i < count; i++) {
+        firstVertex[i] = first;
+        spans[i] = maxVertices[kinds[i]];
+        first += spans[i];
+    }
+    vertices.resize(first);
+    for (size_t i = built; i < count; i++) {
+        writeEntry(i, transform);
+        invalidate(entryBounds[i]);
+        bounds = unionRect(bounds, entryBounds[i]);
+    }
+    if (merge) parent->invalidate(damage);
+    patching.clear();
+    built = count;
+    rebuildAll = false;
+    cachedTransform = transform;
+    geometryDirty = false;
+}
+
+// The result of addObjects. Handles are only created for the objects that are looked up.
+struct ObjectList {
+    HandleTable * table;
+    size_t count;
+    // followed by the slot and generation of each object, and the id and generation of its layer entry
+    uint32_t * entries() {return (uint32_t*)(this + 1);}
+};
+static char objectListKey;
+
+static int objectList_index(lua_State *L) {
+    ObjectList * list = (ObjectList*)lua_touserdata(L, 1);
+    if (lua_type(L, 2) != LUA_TNUMBER) return 0;
+    const lua_Integer i = lua_tointeger(L, 2);
+    if (i < 1 || (size_t)i > list->count) return 0;
+    const uint32_t * entry = list->entries() + (i - 1) * 4;
+    objects::BaseObject * obj = list->table->get(entry[0], entry[1]);
+    if (obj != NULL && entry[2] != HandleTable::NONE) obj = static_cast<objects::object2d::PrimitiveLayer*>(obj)->getFacade(entry[2], entry[3]);
+    if (obj == NULL) return 0; // removed since
+    obj->pushLua(L);
+    return 1;
+}
+
+static int objectList_len(lua_State *L) {
+    lua_pushinteger(L, ((ObjectList*)lua_touserdata(L, 1))->count);
+    return 1;
+}
+
+template<class T>
+int objects::object2d::Group2D::_lua_addObjects(lua_State *L) {
+    T * group = getUpvalue<T>(L);
+    // Kept between calls, so an error while reading doesn't leak it, and large scenes don't reallocate it.
+    static thread_local SceneBatch batch;
+    batch.clear();
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        size_t len;
+        const unsigned char * data = (const unsigned char*)lua_tolstring(L, 1, &len);
+        PackedReader in = {L, data, data + len, 0};
+        batch.roots = readPackedObjects(in, batch, 0, true);
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        batch.roots = readObjectTable(L, 1, batch);
+    }
+    {
+        // Nothing in here can raise a Lua error, so the lock is always released.
+        std::lock_guard<std::mutex> lock(group->getRenderer()->renderlock);
+        group->build(batch, 0, batch.roots, batch.created);
+    }
+    ObjectList * list = (ObjectList*)lua_newuserdata(L, sizeof(ObjectList) + batch.created.size() * 4 * sizeof(uint32_t));
+    list->table = group->getRenderer()->handles;
+    list->count = batch.created.size();
+    for (size_t i = 0; i < list->count; i++) {
+        const ObjectRef& ref = batch.created[i];
+        const LuaHandle handle = ref.obj->getLuaHandle();
+        uint32_t * entry = list->entries() + i * 4;
+        entry[0] = handle.slot;
+        entry[1] = handle.generation;
+        entry[2] = ref.entry;
+        entry[3] = ref.entry == HandleTable::NONE ? 0 : static_cast<objects::object2d::PrimitiveLayer*>(ref.obj)->generation(ref.entry);
+    }
+    lua_pushlightuserdata(L, &objectListKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushcfunction(L, objectList_index);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, objectList_len);
+        lua_setfield(L, -2, "__len");
+        lua_pushliteral(L, "object list");
+        lua_setfield(L, -2, "__metatable");
+        lua_pushlightuserdata(L, &objectListKey);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_setmetatable(L, -2);
     return 1;
 }
 
-GlassesRenderer::GlassesRenderer() {
-    canvas2d = new objects::object2d::Frame2D({WIDTH, HEIGHT});
-    functions->queueTask([this](void*)->void* {
+GlassesRenderer::GlassesRenderer(Computer * comp, const char * s, bool headless): computer(comp), side(s), maxFPS(defaultMaxFPS), presentPending(false) {
+    handles = getHandleTable(computer);
+    batch.stats = &stats;
+    canvas2d = new objects::object2d::Frame2D({WIDTH, HEIGHT}, this);
+    canvas3d = new objects::object3d::Canvas3D(this);
+    if (headless) {
+        // The software renderer can draw on any thread, so this doesn't need the main thread.
+        surface = SDL_CreateRGBSurfaceWithFormat(0, WIDTH, HEIGHT, 32, SDL_PIXELFORMAT_RGBA32);
+        if (surface) ren = SDL_CreateSoftwareRenderer(surface);
+        if (!ren) {
+            std::string err = SDL_GetError();
+            if (surface) SDL_FreeSurface(surface);
+            delete canvas3d;
+            delete canvas2d;
+            throw window_exception("Could not create renderer: " + err);
+        }
+    } else functions->queueTask([this](void*)->void* {
         win = SDL_CreateWindow("CraftOS Terminal: Glasses", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, WIDTH, HEIGHT, SDL_WINDOW_OPENGL & 0);
         ren = SDL_GetRenderer(win);
         if (!ren) {
@@ -1197,39 +3980,174 @@ GlassesRenderer::GlassesRenderer() {
 }
 
 GlassesRenderer::~GlassesRenderer() {
-    std::lock_guard<std::mutex> lock2(renderlock);
     {
-        std::lock_guard<std::mutex> lock(renderTargetsLock);
+        std::unique_lock<std::mutex> lock(renderTargetsLock);
         for (auto it = renderTargets.begin(); it != renderTargets.end(); ++it) {
             if (*it == this)
                 it = renderTargets.erase(it);
             if (it == renderTargets.end()) break;
         }
+        // Once removed from the list, no more frames or presents can start; wait for running ones to finish.
+        renderTargetsIdle.wait(lock, [this]()->bool {return users == 0;});
     }
+    std::lock_guard<std::mutex> lock2(renderlock); // capture may still be drawing
     // Delete allocated resources
+    batch.texture = NULL;
+    if (target) SDL_DestroyTexture(target);
+    for (auto& font : fonts) delete font.second;
+    delete canvas3d; // releases the textures of its frames
+    for (SDL_Texture * texture : deadTextures) SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(ren);
-    SDL_DestroyWindow(win);
+    if (win) SDL_DestroyWindow(win);
+    if (surface) SDL_FreeSurface(surface);
     delete canvas2d;
 }
 
+bool GlassesRenderer::isDirty() const {
+    return canvas2d->isDirty || canvas3d->isDirty;
+}
+
 bool GlassesRenderer::render() {
     std::lock_guard<std::mutex> lock2(renderlock);
-    if (!canvas2d->isDirty) return false;
-    SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
-    SDL_RenderClear(ren);
-    canvas2d->draw(this, {0, 0});
+    if (!isDirty()) {
+        stats.skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     canvas2d->isDirty = false;
+    batch.ren = ren;
+    {
+        std::lock_guard<std::mutex> lock3(textureLock);
+        for (SDL_Texture * texture : deadTextures) SDL_DestroyTexture(texture);
+        deadTextures.clear();
+    }
+    if (canvas3d->isDirty.exchange(false)) {
+        // The 3D canvas is behind everything, so the whole window changes with it.
+        canvas3d->buildScene(scene3d);
+        canvas2d->fullRedraw = true;
+    }
+    updateGeometry(canvas2d);
+    std::vector<SDL_Rect> damage = canvas2d->takeDamage();
+    if (target == NULL && !targetUnsupported) {
+        target = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, WIDTH, HEIGHT);
+        if (target) canvas2d->fullRedraw = true;
+        else targetUnsupported = true;
+    }
+    // Without a target texture, the back buffer doesn't keep its contents, so everything has to be redrawn.
+    if (canvas2d->fullRedraw || target == NULL) damage = {{0, 0, WIDTH, HEIGHT}};
+    canvas2d->fullRedraw = false;
+    if (damage.empty()) {
+        // Something changed, but nothing that can be seen
+        stats.skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (target) SDL_SetRenderTarget(ren, target);
+    drawDamage(canvas2d, damage, {0, 0, 0, 255}, &scene3d);
+    if (target) {
+        SDL_SetRenderTarget(ren, NULL);
+        SDL_RenderCopy(ren, target, NULL, NULL);
+    }
+    stats.frames.fetch_add(1, std::memory_order_relaxed);
+    RenderStats::time(start, stats.renderTime, stats.lastRenderTime, stats.maxRenderTime);
     return true;
 }
 
+void GlassesRenderer::renderFrame(objects::object2d::Frame2D * frame, SDL_Texture *& texture) {
+    if (targetUnsupported || (!frame->isDirty && texture)) return;
+    frame->isDirty = false;
+    updateGeometry(frame);
+    std::vector<SDL_Rect> damage = frame->takeDamage();
+    const SDL_Point size = frame->getSize();
+    if (texture == NULL) {
+        texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, size.x, size.y);
+        if (texture == NULL) {
+            targetUnsupported = true;
+            return;
+        }
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        frame->fullRedraw = true;
+    }
+    if (frame->fullRedraw) damage = {{0, 0, size.x, size.y}};
+    frame->fullRedraw = false;
+    if (damage.empty()) return;
+    SDL_SetRenderTarget(ren, texture);
+    drawDamage(frame, damage, {0, 0, 0, 0}, NULL);
+    SDL_SetRenderTarget(ren, NULL);
+}
+
+void GlassesRenderer::drawDamage(objects::object2d::Frame2D * canvas, const std::vector<SDL_Rect>& damage, SDL_Color background, const Scene3D * scene) {
+    for (const SDL_Rect& rect : damage) {
+        SDL_RenderSetClipRect(ren, &rect);
+        SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_NONE);
+        SDL_SetRenderDrawColor(ren, background.r, background.g, background.b, background.a);
+        SDL_RenderFillRect(ren, &rect);
+        SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
+        if (scene) scene->draw(batch);
+        canvas->draw(this, rect);
+        batch.reset();
+    }
+    SDL_RenderSetClipRect(ren, NULL);
+}
+
+void GlassesRenderer::releaseTexture(SDL_Texture * texture) {
+    std::lock_guard<std::mutex> lock(textureLock);
+    deadTextures.push_back(texture);
+}
+
+GlyphAtlas * GlassesRenderer::getFont(int size) {
+    auto it = fonts.find(size);
+    if (it != fonts.end()) return it->second;
+    GlyphAtlas * font = new GlyphAtlas(ren, size);
+    if (font->texture == NULL) {
+        delete font;
+        font = NULL;
+    } else {
+        font->stats = &stats;
+        font->generation = &glyphGeneration;
+    }
+    fonts[size] = font;
+    return font;
+}
+
+bool GlassesRenderer::capture(std::vector<Uint8>& pixels) {
+    if (render()) queuePresent();
+    std::lock_guard<std::mutex> lock(renderlock);
+    pixels.resize(WIDTH * HEIGHT * 4);
+    // The window's back buffer is undefined after presenting, so read the canvas texture when there is one.
+    if (target) SDL_SetRenderTarget(ren, target);
+    const int err = SDL_RenderReadPixels(ren, NULL, SDL_PIXELFORMAT_RGBA32, pixels.data(), WIDTH * 4);
+    if (target) SDL_SetRenderTarget(ren, NULL);
+    return err == 0;
+}
+
+void GlassesRenderer::rebuildGeometry() {
+    // Anything that isn't thread-safe (like rasterizing glyphs) was done while collecting the objects,
+    // so the objects can be rebuilt independently of each other.
+    size_t cost = 0;
+    for (const auto& obj : dirtyObjects) cost += obj.first->geometryCost();
+    auto fn = [this](size_t i) {dirtyObjects[i].first->rebuild(this, dirtyObjects[i].second);};
+    if (geometryPool && cost >= PARALLEL_BUILD_COST) geometryPool->run(dirtyObjects.size(), fn);
+    else for (size_t i = 0; i < dirtyObjects.size(); i++) fn(i);
+    dirtyObjects.clear();
+}
+
+void GlassesRenderer::updateGeometry(objects::object2d::Frame2D * frame) {
+    const unsigned int generation = glyphGeneration;
+    frame->update(this, Transform2D());
+    rebuildGeometry();
+    // Text that was checked before an atlas grew later in the walk still points to the old texture.
+    if (glyphGeneration != generation) {
+        frame->update(this, Transform2D());
+        rebuildGeometry();
+    }
+    frame->updateBounds();
+}
+
 class plethora_glasses: public peripheral {
     GlassesRenderer renderer;
 public:
     static library_t methods;
-    plethora_glasses(lua_State *L, const char * side) {
-        renderer.computer = get_comp(L);
-        renderer.side = side;
-    }
+    plethora_glasses(lua_State *L, const char * side): renderer(get_comp(L), side, lua_isnoneornil(L, 3) ? defaultHeadless : lua_toboolean(L, 3)) {}
     ~plethora_glasses(){}
     static peripheral * init(lua_State *L, const char * side) {return new plethora_glasses(L, side);}
     static void deinit(peripheral * p) {delete (plethora_glasses*)p;}
@@ -1237,13 +4155,63 @@ public:
     int call(lua_State *L, const char * method) override {
         const std::string m(method);
         if (m == "canvas") {
-            renderer.canvas2d->toLua<objects::object2d::Frame2D>(L, savePointer(L, renderer.canvas2d));
+            pushObject(L, renderer.canvas2d);
             return 1;
         } else if (m == "canvas3d") {
-            lua_pushnil(L); // todo
+            pushObject(L, renderer.canvas3d);
             return 1;
         } else if (m == "forceRender") {
-            renderer.canvas2d->isDirty = true;
+            renderer.canvas2d->fullRedraw = true;
+            renderer.canvas2d->setDirty();
+            renderer.canvas3d->setDirty();
+            return 0;
+        } else if (m == "capture") {
+            const std::string format = luaL_optstring(L, 1, "rgba");
+            if (format != "rgba" && format != "png") return luaL_error(L, "bad argument #1 (invalid format '%s')", format.c_str());
+            std::vector<Uint8> pixels;
+            if (!renderer.capture(pixels)) return luaL_error(L, "Could not read frame: %s", SDL_GetError());
+            if (format == "png") {
+                const std::string png = encodePNG(pixels.data(), WIDTH, HEIGHT);
+                lua_pushlstring(L, png.data(), png.size());
+            } else lua_pushlstring(L, (const char*)pixels.data(), pixels.size());
+            lua_pushinteger(L, WIDTH);
+            lua_pushinteger(L, HEIGHT);
+            return 3;
+        } else if (m == "getMaxFPS") {
+            lua_pushinteger(L, renderer.maxFPS);
+            return 1;
+        } else if (m == "setMaxFPS") {
+            const int fps = luaL_checkinteger(L, 1);
+            if (fps < 0) return luaL_error(L, "bad argument #1 (value out of range)");
+            renderer.maxFPS = fps;
+            return 0;
+        } else if (m == "getRenderStats") {
+            const RenderStats& stats = renderer.stats;
+            lua_createtable(L, 0, 16);
+            const std::pair<const char *, const std::atomic<uint64_t>*> counters[] = {
+                {"frames", &stats.frames}, {"skipped", &stats.skipped}, {"presents", &stats.presents}, {"drawCalls", &stats.drawCalls},
+                {"vertices", &stats.vertices}, {"glyphs", &stats.glyphs}, {"textLayouts", &stats.textLayouts}, {"triangulations", &stats.triangulations}
+            };
+            for (const auto& c : counters) {
+                lua_pushnumber(L, (lua_Number)c.second->load(std::memory_order_relaxed));
+                lua_setfield(L, -2, c.first);
+            }
+            // Times are returned in milliseconds
+            const std::pair<const char *, double> times[] = {
+                {"renderTime", stats.renderTime.load(std::memory_order_relaxed) / 1000.0},
+                {"lastRenderTime", stats.lastRenderTime.load(std::memory_order_relaxed) / 1000.0},
+                {"maxRenderTime", stats.maxRenderTime.load(std::memory_order_relaxed) / 1000.0},
+                {"presentTime", stats.presentTime.load(std::memory_order_relaxed) / 1000.0},
+                {"lastPresentTime", stats.lastPresentTime.load(std::memory_order_relaxed) / 1000.0},
+                {"maxPresentTime", stats.maxPresentTime.load(std::memory_order_relaxed) / 1000.0}
+            };
+            for (const auto& t : times) {
+                lua_pushnumber(L, t.second);
+                lua_setfield(L, -2, t.first);
+            }
+            return 1;
+        } else if (m == "resetRenderStats") {
+            renderer.stats.reset();
             return 0;
         } else return luaL_error(L, "No such method");
     }
@@ -1254,50 +4222,112 @@ public:
 static luaL_Reg plethora_methods_reg[] = {
     {"canvas", NULL},
     {"canvas3d", NULL},
+    {"capture", NULL},
+    {"getMaxFPS", NULL},
+    {"getRenderStats", NULL},
+    {"resetRenderStats", NULL},
+    {"setMaxFPS", NULL},
     {NULL, NULL}
 };
 
 library_t plethora_glasses::methods = {"glasses", plethora_methods_reg, nullptr, nullptr};
 
+// Releases renderers taken from renderTargets, letting a closing renderer finish its destructor.
+static void releaseRenderTargets(const std::vector<GlassesRenderer*>& terms) {
+    std::lock_guard<std::mutex> lock(renderTargetsLock);
+    bool idle = false;
+    for (GlassesRenderer * term : terms)
+        if (--term->users == 0) idle = true;
+    if (idle) renderTargetsIdle.notify_all();
+}
+
+// Runs on the main thread. Presents are queued separately for each renderer, so a slow window doesn't hold up the others.
+static void* presentRenderer(void* p) {
+    GlassesRenderer * term = (GlassesRenderer*)p;
+    {
+        std::lock_guard<std::mutex> lock(renderTargetsLock);
+        if (std::find(renderTargets.begin(), renderTargets.end(), term) == renderTargets.end()) return NULL; // already closed
+        term->users++;
+    }
+    {
+        // Only waits for a frame of this renderer.
+        std::lock_guard<std::mutex> lock(term->renderlock);
+        // Anything rendered after this point needs another present.
+        term->presentPending = false;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        SDL_RenderPresent(term->ren);
+        term->stats.presents.fetch_add(1, std::memory_order_relaxed);
+        RenderStats::time(start, term->stats.presentTime, term->stats.lastPresentTime, term->stats.maxPresentTime);
+    }
+    releaseRenderTargets({term});
+    return NULL;
+}
+
+void GlassesRenderer::queuePresent() {
+    if (win == NULL) return; // headless
+    // If a present is still waiting, it will show this frame as well.
+    if (!presentPending.exchange(true)) functions->queueTask(presentRenderer, this, true);
+}
+
 static void glassesRenderLoop() {
-    std::list<GlassesRenderer*> * renderList = new std::list<GlassesRenderer*>;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
     while (renderRunning) {
-        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(renderNotifyLock);
+            auto ready = []()->bool {return renderPending || !renderRunning;};
+            if (deadline == std::chrono::steady_clock::time_point::max()) renderNotify.wait(lock, ready);
+            else renderNotify.wait_until(lock, deadline, ready);
+            renderPending = false;
+        }
+        if (!renderRunning) break;
+        deadline = std::chrono::steady_clock::time_point::max();
+        // Renders without holding the list lock, so presents and new windows don't wait for every frame.
+        std::vector<GlassesRenderer*> targets;
         {
             std::lock_guard<std::mutex> lock(renderTargetsLock);
-            for (GlassesRenderer* term : renderTargets) if (term->render()) {
-                term->renderlock.lock();
-                renderList->push_back(term);
-            }
+            targets.assign(renderTargets.begin(), renderTargets.end());
+            for (GlassesRenderer * term : targets) term->users++;
         }
-        if (!renderList->empty()) {
-            functions->queueTask([](void* p)->void* {
-                auto renderList = (std::list<GlassesRenderer*>*)p;
-                for (GlassesRenderer* term : *renderList) {
-                    SDL_RenderPresent(term->ren);
-                    term->renderlock.unlock();
-                }
-                delete renderList;
-                return NULL;
-            }, renderList, true);
-            renderList = new std::list<GlassesRenderer*>;
+        for (GlassesRenderer* term : targets) {
+            if (!term->isDirty()) {
+                term->stats.skipped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now < term->nextFrame) {
+                // Rendered too recently; come back when the frame time is up.
+                deadline = std::min(deadline, term->nextFrame);
+                continue;
+            }
+            if (!term->render()) continue;
+            int fps = term->maxFPS;
+            if (fps <= 0) fps = functions->config->clockSpeed;
+            term->nextFrame = now + std::chrono::microseconds(1000000 / std::max(fps, 1));
+            term->queuePresent();
         }
-        const long long count = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
-        //printf("Render thread took %lld us (%lld fps)\n", count, count == 0 ? 1000000 : 1000000 / count);
-        long long t = (1000000/functions->config->clockSpeed) - count;
-        if (t > 0) std::this_thread::sleep_for(std::chrono::microseconds(t));
+        releaseRenderTargets(targets);
     }
-    delete renderList;
 }
 
 static bool sdlHook(SDL_Event * e, Computer * comp, Terminal * term, void* ud) {
     if (e->window.event == SDL_WINDOWEVENT_CLOSE) {
-        for (GlassesRenderer * ren : renderTargets) {
-            if (e->window.windowID == SDL_GetWindowID(ren->win)) {
-                functions->detachPeripheral(ren->computer, ren->side);
-                return true;
+        Computer * computer = NULL;
+        std::string side;
+        {
+            std::lock_guard<std::mutex> lock(renderTargetsLock);
+            for (GlassesRenderer * ren : renderTargets) {
+                if (ren->win && e->window.windowID == SDL_GetWindowID(ren->win)) {
+                    computer = ren->computer;
+                    side = ren->side;
+                    break;
+                }
             }
         }
+        // Detached outside the lock, since deleting the renderer takes it.
+        if (computer) {
+            functions->detachPeripheral(computer, side);
+            return true;
+        }
     }
     return false;
 }
@@ -1315,6 +4345,12 @@ PluginInfo * plugin_init(const PluginFunctions * func, const path_t& path) {
         return &info;
     }
     TTF_Init();
+    if (func->structure_version >= 2) {
+        func->registerConfigSetting("glasses.maxFPS", CONFIG_TYPE_INTEGER, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+        func->registerConfigSetting("glasses.headless", CONFIG_TYPE_BOOLEAN, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+    }
+    const unsigned cores = std::thread::hardware_concurrency();
+    if (cores > 1) geometryPool = new WorkerPool(std::min(cores - 1, 7U));
     renderThread = std::thread(glassesRenderLoop);
     func->registerPeripheral("glasses", &plethora_glasses::init);
     func->registerSDLEvent(SDL_WINDOWEVENT, sdlHook, NULL);
@@ -1326,17 +4362,13 @@ _declspec(dllexport)
 #endif
 int luaopen_glasses(lua_State *L) {
     Computer * comp = get_comp(L);
-    if (comp->userdata.find(POINTERLIST_INDEX) == comp->userdata.end()) {
-        comp->userdata[POINTERLIST_INDEX] = new pointerlist_t;
-        comp->userdata_destructors[POINTERLIST_INDEX] = [](Computer * comp, int idx, void* ptr) {
-            pointerlist_t * list = (pointerlist_t*)ptr;
-            while (list) {
-                pointerlist_t * next = list->next;
-                delete list;
-                list = next;
-            }
-        };
+    if (functions->structure_version >= 2) {
+        try {defaultMaxFPS = functions->getConfigSettingInt("glasses.maxFPS");}
+        catch (...) {functions->setConfigSettingInt("glasses.maxFPS", defaultMaxFPS);}
+        try {defaultHeadless = functions->getConfigSettingBool("glasses.headless");}
+        catch (...) {functions->setConfigSettingBool("glasses.headless", defaultHeadless);}
     }
+    getHandleTable(comp);
     return 0;
 }
 
@@ -1346,7 +4378,12 @@ _declspec(dllexport)
 void plugin_deinit(PluginInfo * info) {
     if (!info->failureReason.empty()) return;
     renderRunning = false;
+    {
+        std::lock_guard<std::mutex> lock(renderNotifyLock);
+        renderNotify.notify_all();
+    }
     renderThread.join();
+    delete geometryPool;
     TTF_Quit();
 }
 }
\ No newline at end of file
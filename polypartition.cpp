@@ -36,13 +36,13 @@ TPPLPoly::TPPLPoly() {
 
 TPPLPoly::~TPPLPoly() {
   if (points) {
-    delete[] points;
+    TPPLDeleteArray(points, numpoints);
   }
 }
 
 void TPPLPoly::Clear() {
   if (points) {
-    delete[] points;
+    TPPLDeleteArray(points, numpoints);
   }
   hole = false;
   numpoints = 0;
@@ -52,7 +52,7 @@ void TPPLPoly::Clear() {
 void TPPLPoly::Init(long numpoints) {
   Clear();
   this->numpoints = numpoints;
-  points = new TPPLPoint[numpoints];
+  points = TPPLNewArray<TPPLPoint>(numpoints);
 }
 
 void TPPLPoly::Triangle(TPPLPoint &p1, TPPLPoint &p2, TPPLPoint &p3) {
@@ -68,7 +68,7 @@ TPPLPoly::TPPLPoly(const TPPLPoly &src) :
   numpoints = src.numpoints;
 
   if (numpoints > 0) {
-    points = new TPPLPoint[numpoints];
+    points = TPPLNewArray<TPPLPoint>(numpoints);
     memcpy(points, src.points, numpoints * sizeof(TPPLPoint));
   }
 }
@@ -79,7 +79,7 @@ TPPLPoly &TPPLPoly::operator=(const TPPLPoly &src) {
   numpoints = src.numpoints;
 
   if (numpoints > 0) {
-    points = new TPPLPoint[numpoints];
+    points = TPPLNewArray<TPPLPoint>(numpoints);
     memcpy(points, src.points, numpoints * sizeof(TPPLPoint));
   }
 
@@ -452,7 +452,7 @@ int TPPLPartition::Triangulate_EC(TPPLPoly *poly, TPPLPolyList *triangles) {
 
   numvertices = poly->GetNumPoints();
 
-  vertices = new PartitionVertex[numvertices];
+  vertices = TPPLNewArray<PartitionVertex>(numvertices);
   for (i = 0; i < numvertices; i++) {
     vertices[i].isActive = true;
     vertices[i].p = poly->GetPoint(i);
@@ -491,7 +491,7 @@ int TPPLPartition::Triangulate_EC(TPPLPoly *poly, TPPLPolyList *triangles) {
       }
     }
     if (!earfound) {
-      delete[] vertices;
+      TPPLDeleteArray(vertices, numvertices);
       return 0;
     }
 
@@ -517,7 +517,7 @@ int TPPLPartition::Triangulate_EC(TPPLPoly *poly, TPPLPolyList *triangles) {
     }
   }
 
-  delete[] vertices;
+  TPPLDeleteArray(vertices, numvertices);
 
   return 1;
 }
@@ -989,6 +989,11 @@ int TPPLPartition::ConvexPartition_OPT(TPPLPoly *poly, TPPLPolyList *parts) {
   bool ijreal, jkreal;
 
   n = poly->GetNumPoints();
+  // A triangle has no diagonals to choose from.
+  if (n == 3) {
+    parts->push_back(*poly);
+    return 1;
+  }
   vertices = new PartitionVertex[n];
 
   dpstates = new DPState2 *[n];
@@ -1299,7 +1304,7 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
   }
 
   maxnumvertices = numvertices * 3;
-  vertices = new MonotoneVertex[maxnumvertices];
+  vertices = TPPLNewArray<MonotoneVertex>(maxnumvertices);
   newnumvertices = numvertices;
 
   polystartindex = 0;
@@ -1323,14 +1328,14 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
   }
 
   // Construct the priority queue.
-  long *priority = new long[numvertices];
+  long *priority = TPPLNewArray<long>(numvertices);
   for (i = 0; i < numvertices; i++) {
     priority[i] = i;
   }
   std::sort(priority, &(priority[numvertices]), VertexSorter(vertices));
 
   // Determine vertex types.
-  TPPLVertexType *vertextypes = new TPPLVertexType[maxnumvertices];
+  TPPLVertexType *vertextypes = TPPLNewArray<TPPLVertexType>(maxnumvertices);
   for (i = 0; i < numvertices; i++) {
     v = &(vertices[i]);
     vprev = &(vertices[v->previous]);
@@ -1354,18 +1359,18 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
   }
 
   // Helpers.
-  long *helpers = new long[maxnumvertices];
+  long *helpers = TPPLNewArray<long>(maxnumvertices);
 
   // Binary search tree that holds edges intersecting the scanline.
   // Note that while set doesn't actually have to be implemented as
   // a tree, complexity requirements for operations are the same as
   // for the balanced binary search tree.
-  std::set<ScanLineEdge> edgeTree;
+  ScanLineEdgeSet edgeTree;
   // Store iterators to the edge tree elements.
   // This makes deleting existing edges much faster.
-  std::set<ScanLineEdge>::iterator *edgeTreeIterators, edgeIter;
-  edgeTreeIterators = new std::set<ScanLineEdge>::iterator[maxnumvertices];
-  std::pair<std::set<ScanLineEdge>::iterator, bool> edgeTreeRet;
+  ScanLineEdgeSet::iterator *edgeTreeIterators, edgeIter;
+  edgeTreeIterators = TPPLNewArray<ScanLineEdgeSet::iterator>(maxnumvertices);
+  std::pair<ScanLineEdgeSet::iterator, bool> edgeTreeRet;
   for (i = 0; i < numvertices; i++) {
     edgeTreeIterators[i] = edgeTree.end();
   }
@@ -1517,7 +1522,7 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
       break;
   }
 
-  char *used = new char[newnumvertices];
+  char *used = TPPLNewArray<char>(newnumvertices);
   memset(used, 0, newnumvertices * sizeof(char));
 
   if (!error) {
@@ -1553,12 +1558,12 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
   }
 
   // Cleanup.
-  delete[] vertices;
-  delete[] priority;
-  delete[] vertextypes;
-  delete[] edgeTreeIterators;
-  delete[] helpers;
-  delete[] used;
+  TPPLDeleteArray(vertices, maxnumvertices);
+  TPPLDeleteArray(priority, numvertices);
+  TPPLDeleteArray(vertextypes, maxnumvertices);
+  TPPLDeleteArray(edgeTreeIterators, maxnumvertices);
+  TPPLDeleteArray(helpers, maxnumvertices);
+  TPPLDeleteArray(used, newnumvertices);
 
   if (error) {
     return 0;
@@ -1569,8 +1574,8 @@ int TPPLPartition::MonotonePartition(TPPLPolyList *inpolys, TPPLPolyList *monoto
 
 // Adds a diagonal to the doubly-connected list of vertices.
 void TPPLPartition::AddDiagonal(MonotoneVertex *vertices, long *numvertices, long index1, long index2,
-        TPPLVertexType *vertextypes, std::set<ScanLineEdge>::iterator *edgeTreeIterators,
-        std::set<ScanLineEdge> *edgeTree, long *helpers) {
+        TPPLVertexType *vertextypes, ScanLineEdgeSet::iterator *edgeTreeIterators,
+        ScanLineEdgeSet *edgeTree, long *helpers) {
   long newindex1, newindex2;
 
   newindex1 = *numvertices;
@@ -1713,8 +1718,8 @@ int TPPLPartition::TriangulateMonotone(TPPLPoly *inPoly, TPPLPolyList *triangles
     i = i2;
   }
 
-  char *vertextypes = new char[numpoints];
-  long *priority = new long[numpoints];
+  char *vertextypes = TPPLNewArray<char>(numpoints);
+  long *priority = TPPLNewArray<long>(numpoints);
 
   // Merge left and right vertex chains.
   priority[0] = topindex;
@@ -1763,7 +1768,7 @@ int TPPLPartition::TriangulateMonotone(TPPLPoly *inPoly, TPPLPolyList *triangles
   priority[i] = bottomindex;
   vertextypes[bottomindex] = 0;
 
-  long *stack = new long[numpoints];
+  long *stack = TPPLNewArray<long>(numpoints);
   long stackptr = 0;
 
   stack[0] = priority[0];
@@ -1821,9 +1826,9 @@ int TPPLPartition::TriangulateMonotone(TPPLPoly *inPoly, TPPLPolyList *triangles
     triangles->push_back(triangle);
   }
 
-  delete[] priority;
-  delete[] vertextypes;
-  delete[] stack;
+  TPPLDeleteArray(priority, numpoints);
+  TPPLDeleteArray(vertextypes, numpoints);
+  TPPLDeleteArray(stack, numpoints);
 
   return 1;
 }
@@ -25,10 +25,42 @@
 #define POLYPARTITION_H
 
 #include <list>
+#include <new>
 #include <set>
 
 typedef double tppl_float;
 
+// Temporary arrays and polygon points are allocated through TPPL_ALLOCATOR
+// as well when it's defined, so that an arena can take all of the allocations.
+#ifdef TPPL_ALLOCATOR
+template <class T>
+T *TPPLNewArray(long n) {
+  T *p = TPPL_ALLOCATOR(T)().allocate(n);
+  for (long i = 0; i < n; i++) {
+    new (p + i) T();
+  }
+  return p;
+}
+
+template <class T>
+void TPPLDeleteArray(T *p, long n) {
+  for (long i = 0; i < n; i++) {
+    p[i].~T();
+  }
+  TPPL_ALLOCATOR(T)().deallocate(p, n);
+}
+#else
+template <class T>
+T *TPPLNewArray(long n) {
+  return new T[n];
+}
+
+template <class T>
+void TPPLDeleteArray(T *p, long) {
+  delete[] p;
+}
+#endif
+
 enum TPPLOrientation {
   TPPL_ORIENTATION_CW = -1,
   TPPL_ORIENTATION_NONE = 0,
@@ -240,6 +272,12 @@ public:
     bool IsConvex(const TPPLPoint &p1, const TPPLPoint &p2, const TPPLPoint &p3) const;
   };
 
+#ifdef TPPL_ALLOCATOR
+  typedef std::set<ScanLineEdge, std::less<ScanLineEdge>, TPPL_ALLOCATOR(ScanLineEdge)> ScanLineEdgeSet;
+#else
+  typedef std::set<ScanLineEdge> ScanLineEdgeSet;
+#endif
+
   // Standard helper functions.
   bool IsConvex(TPPLPoint &p1, TPPLPoint &p2, TPPLPoint &p3);
   bool IsReflex(TPPLPoint &p1, TPPLPoint &p2, TPPLPoint &p3);
@@ -265,8 +303,8 @@ public:
   // Helper functions for MonotonePartition.
   bool Below(TPPLPoint &p1, TPPLPoint &p2);
   void AddDiagonal(MonotoneVertex *vertices, long *numvertices, long index1, long index2,
-          TPPLVertexType *vertextypes, std::set<ScanLineEdge>::iterator *edgeTreeIterators,
-          std::set<ScanLineEdge> *edgeTree, long *helpers);
+          TPPLVertexType *vertextypes, ScanLineEdgeSet::iterator *edgeTreeIterators,
+          ScanLineEdgeSet *edgeTree, long *helpers);
 
   // Triangulates a monotone polygon, used in Triangulate_MONO.
   int TriangulateMonotone(TPPLPoly *inPoly, TPPLPolyList *triangles);
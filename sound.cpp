@@ -28,14 +28,24 @@
  * SOFTWARE.
  */
 
+#ifndef SOUND_SYNTH_ONLY
 #include <CraftOS-PC.hpp>
 #include <SDL2/SDL_mixer.h>
+#else
+// Only the synthesizer is compiled (see bench/sound_bench.cpp), so no Lua, CraftOS-PC or SDL_mixer is needed.
+#include <SDL2/SDL.h>
+#include <cstring>
+#endif
+#include <atomic>
 #include <cmath>
 #include <chrono>
 #include <random>
 #include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
 #define NUM_CHANNELS ((int)(ptrdiff_t)get_comp(L)->userdata[ChannelInfo::identifier+1])
-#define channelGroup(id) ((id) | 0x74A800)
+#define VOICE_GROUP 0x74A800
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -57,36 +67,101 @@ enum class InterpolationMode {
     Linear
 };
 
+enum class SongEventType {
+    Note,
+    NoteOff,
+    Volume,
+    Pan,
+    Fade,
+    Marker
+};
+
+struct SongInstrument {
+    WaveType wavetype = WaveType::Square;
+    double duty = 0.5;
+    float volume = 1.0;
+    float pan = 0.0;
+    double release = 0.0;
+    InterpolationMode interpolation = InterpolationMode::None;
+    std::vector<double> customWave;
+};
+
+struct SongEvent {
+    uint64_t time; // in samples from the start of the song
+    SongEventType type;
+    int instrument; // -1 to keep the current instrument
+    double value;
+    float volume;
+    unsigned int glide; // samples to glide to a note's frequency over, 0 to use the channel's portamento
+};
+
+struct SongRow {
+    uint64_t time;
+    int order;
+    int row;
+};
+
+// A song is compiled into a per-channel list of timed events when it's loaded, so
+// the audio thread only has to compare sample counts to play it back.
+struct Song {
+    std::vector<SongInstrument> instruments;
+    std::vector<std::vector<SongEvent>> channels;
+    std::vector<SongRow> rows;
+    std::vector<uint64_t> orderStart;
+    uint64_t length = 0;
+    uint64_t loopStart = 0;
+    bool loop = false;
+};
+
+#ifdef SOUND_SYNTH_ONLY
+struct Computer;
+#endif
+struct Voice;
+
+// Per-computer mix bus. All channels of a computer are scaled by its gain.
+// The gain is shared by the computer's channels, so it isn't guarded by any one channel's lock.
+struct SoundBus {
+    std::atomic<float> gain{1.0f};
+};
+
 struct ChannelInfo {
     static constexpr int identifier = 0x1d4c1cd0;
     int id;
-    int channelNumber;
     double position = 0.0;
     WaveType wavetype = WaveType::None;
     double duty = 0.5;
-    unsigned int frequency = 0;
+    double frequency = 0.0;
+    double glideTarget = 0.0;
+    double glideStep = 1.0;
+    unsigned int glideSamples = 0;
+    unsigned int portamento = 0;
     float amplitude = 1.0;
     float newAmplitude = -1;
     float pan = 0.0;
     unsigned int fadeSamples = 0;
     unsigned int fadeSamplesMax = 0;
     float fadeSamplesInit = 0.0;
-    bool halting = false;
     std::mutex lock;
     int channelCount = 4;
     int fadeDirection = -1;
     double customWave[512];
     int customWaveSize;
     InterpolationMode interpolation;
+    Computer * comp = NULL;
+    SoundBus * bus = NULL;
+    Voice * voice = NULL;
+    std::shared_ptr<Song> song;
+    size_t songEvent = 0;
+    uint64_t songPosition = 0;
+    bool songPlaying = false;
+    int songInstrument = -1;
 };
 
-static Uint8 empty_audio[32];
-static Mix_Chunk * empty_chunk;
 static int targetFrequency = 0;
 static Uint16 targetFormat = 0;
 static int targetChannels = 0;
 static std::default_random_engine rng;
-static const PluginFunctions * func;
+static void (*markerHandler)(ChannelInfo * info, double marker) = NULL;
 constexpr int ChannelInfo::identifier;
 
 #if SDL_BYTEORDER == SDL_LIL_ENDIAN
@@ -138,22 +213,128 @@ static float getSample(ChannelInfo * c, double amplitude, double pos) {
 template<typename T> static T min(T a, T b) {return a < b ? a : b;}
 template<typename T> static T max(T a, T b) {return a > b ? a : b;}
 
-static void generateWaveform(int channel, void* stream, int length, void* udata) {
-    ChannelInfo * info = (ChannelInfo*)udata;
+static void startFade(ChannelInfo * info, double time) {
+    if (time < -0.000001) {
+        info->fadeSamplesInit = 1 - info->amplitude;
+        info->fadeDirection = 1;
+        info->fadeSamples = info->fadeSamplesMax = -time * targetFrequency;
+    } else if (time < 0.000001) {
+        info->fadeSamplesInit = 0.0;
+        info->fadeSamples = info->fadeSamplesMax = 0;
+    } else {
+        info->fadeSamplesInit = info->amplitude;
+        info->fadeDirection = -1;
+        info->fadeSamples = info->fadeSamplesMax = time * targetFrequency;
+    }
+}
+
+// Slides the frequency exponentially, so the pitch changes by the same number of semitones every sample.
+static void glideTo(ChannelInfo * info, double frequency, unsigned int samples) {
+    if (samples == 0 || info->frequency <= 0.0 || frequency <= 0.0 || info->frequency == frequency) {
+        info->frequency = frequency;
+        info->glideSamples = 0;
+        return;
+    }
+    info->glideTarget = frequency;
+    info->glideStep = pow(frequency / info->frequency, 1.0 / samples);
+    info->glideSamples = samples;
+}
+
+static void applySongEvent(ChannelInfo * info, const Song * song, const SongEvent& ev) {
+    switch (ev.type) {
+        case SongEventType::Note: {
+            if (ev.instrument >= 0 && ev.instrument != info->songInstrument) {
+                const SongInstrument& inst = song->instruments[ev.instrument];
+                info->wavetype = inst.wavetype;
+                info->duty = inst.duty;
+                info->pan = inst.pan;
+                info->interpolation = inst.interpolation;
+                if (inst.wavetype == WaveType::Custom) {
+                    memcpy(info->customWave, inst.customWave.data(), inst.customWave.size() * sizeof(double));
+                    info->customWaveSize = inst.customWave.size();
+                    info->position = 0.0;
+                } else if (inst.wavetype == WaveType::PitchedNoise) {
+                    for (int i = 0; i < 512; i++) info->customWave[i] = ((float)rng() / (float)rng.max()) * 2.0f - 1.0f;
+                    info->customWaveSize = 512;
+                    info->position = 0.0;
+                }
+                info->songInstrument = ev.instrument;
+            }
+            const float volume = info->songInstrument >= 0 ? song->instruments[info->songInstrument].volume : 1.0f;
+            glideTo(info, ev.value, ev.glide ? ev.glide : info->portamento);
+            info->fadeSamples = info->fadeSamplesMax = 0;
+            info->fadeSamplesInit = 0.0f;
+            info->newAmplitude = volume * ev.volume;
+            break;
+        }
+        case SongEventType::NoteOff:
+            if (info->songInstrument >= 0 && song->instruments[info->songInstrument].release > 0.0) startFade(info, song->instruments[info->songInstrument].release);
+            else info->newAmplitude = 0;
+            break;
+        case SongEventType::Volume:
+            info->newAmplitude = (info->songInstrument >= 0 ? song->instruments[info->songInstrument].volume : 1.0f) * ev.volume;
+            break;
+        case SongEventType::Pan: info->pan = ev.value; break;
+        case SongEventType::Fade: startFade(info, ev.value); break;
+        case SongEventType::Marker: if (markerHandler) markerHandler(info, ev.value); break;
+    }
+}
+
+static void advanceSong(ChannelInfo * info) {
+    const Song * song = info->song.get();
+    const std::vector<SongEvent>& events = song->channels[info->id];
+    while (info->songEvent < events.size() && events[info->songEvent].time <= info->songPosition)
+        applySongEvent(info, song, events[info->songEvent++]);
+    if (++info->songPosition >= song->length) {
+        if (song->loop) {
+            info->songPosition = song->loopStart;
+            info->songEvent = std::lower_bound(events.begin(), events.end(), song->loopStart, [](const SongEvent& ev, uint64_t t) {return ev.time < t;}) - events.begin();
+        } else info->songPlaying = false;
+    }
+}
+
+// An idle channel can't make any sound until one of its settings is changed.
+static bool channelIdle(const ChannelInfo * info) {
+    if (info->songPlaying) return false;
+    return info->wavetype == WaveType::None || info->frequency == 0 ||
+        (info->amplitude < 0.0001 && info->newAmplitude < 0.0001 && info->fadeSamplesMax == 0) ||
+        (info->bus && info->bus->gain < 0.0001);
+}
+
+static void writeSilence(void* stream, int length) {
+    if (SDL_AUDIO_ISSIGNED(targetFormat)) memset(stream, 0, length);
+    else for (int i = 0; i < length; i += SDL_AUDIO_BITSIZE(targetFormat) / 8) writeSample(0.0, (uint8_t*)stream + i);
+}
+
+/*
+ * Renders a channel into a buffer.
+ * Returns: Whether the channel is still audible afterwards
+ */
+static bool generateWaveform(ChannelInfo * info, void* stream, int length) {
     std::lock_guard<std::mutex> lock(info->lock);
+    if (channelIdle(info)) {
+        writeSilence(stream, length);
+        return false;
+    }
+    const float gain = info->bus ? info->bus->gain.load() : 1.0f;
     const int sampleSize = (SDL_AUDIO_BITSIZE(targetFormat) / 8) * targetChannels;
     int numSamples = length / sampleSize;
     for (int i = 0; i < numSamples; i++) {
-        //if (info->id == 0) printf("%f %f\n", info->position, getSample(info, info->amplitude, info->position));
+        if (info->songPlaying) advanceSong(info);
+        //if (info->id == 0) printf("%f %f\n", info->position, getSample(info, info->amplitude * gain, info->position));
         if (targetChannels == 1) {
-            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude, info->position), (uint8_t*)stream + i * sampleSize);
+            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * gain, info->position), (uint8_t*)stream + i * sampleSize);
         } else {
-            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * min(1.0 + info->pan, 1.0), info->position), (uint8_t*)stream + i * sampleSize);
-            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * min(1.0 - info->pan, 1.0), info->position), (uint8_t*)stream + i * sampleSize + (SDL_AUDIO_BITSIZE(targetFormat) / 8));
-            for (int j = 2; j < targetChannels; j++) writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude, info->position), (uint8_t*)stream + i * sampleSize + j * (SDL_AUDIO_BITSIZE(targetFormat) / 8));
+            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * gain * min(1.0 + info->pan, 1.0), info->position), (uint8_t*)stream + i * sampleSize);
+            writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * gain * min(1.0 - info->pan, 1.0), info->position), (uint8_t*)stream + i * sampleSize + (SDL_AUDIO_BITSIZE(targetFormat) / 8));
+            for (int j = 2; j < targetChannels; j++) writeSample(info->frequency == 0 ? 0.0 : getSample(info, info->amplitude * gain, info->position), (uint8_t*)stream + i * sampleSize + j * (SDL_AUDIO_BITSIZE(targetFormat) / 8));
+        }
+        if (info->wavetype == WaveType::PitchedNoise) info->position += info->frequency / (double)targetFrequency / 32.0;
+        else info->position += info->frequency / (double)targetFrequency;
+        if (info->glideSamples > 0) {
+            if (--info->glideSamples == 0) info->frequency = info->glideTarget;
+            else info->frequency *= info->glideStep;
         }
-        if (info->wavetype == WaveType::PitchedNoise) info->position += (double)info->frequency / (double)targetFrequency / 32.0;
-        else info->position += (double)info->frequency / (double)targetFrequency;
         if (info->newAmplitude >= 0) {
             switch (info->wavetype) {
             case WaveType::Square: case WaveType::Sawtooth: case WaveType::RSawtooth:
@@ -177,20 +358,193 @@ static void generateWaveform(int channel, void* stream, int length, void* udata)
             }
         }
     }
+    return !channelIdle(info);
+}
+
+#ifndef SOUND_SYNTH_ONLY
+
+enum class StealPolicy {
+    None,
+    Oldest,
+    Quietest
+};
+
+// A voice is an SDL_mixer channel shared by all computers. Voices are lent to
+// computer channels when they're used, so the total number of mixer channels
+// stays bounded no matter how many computers are open.
+struct Voice {
+    int channelNumber;
+    ChannelInfo * owner = NULL;
+    uint64_t allocated = 0;
+    bool playing = false; // whether the effect is registered; a parked voice only loops silence
+    bool parking = false;
+    bool parkQueued = false;
+};
+
+static Uint8 empty_audio[32];
+static Mix_Chunk * empty_chunk;
+static const PluginFunctions * func;
+static std::vector<Voice*> voices;
+static std::mutex poolLock; // held while (re)assigning voices; never taken on the audio thread
+static std::mutex voiceLock; // protects Voice::owner and ChannelInfo::voice against the audio thread
+static uint64_t voiceCounter = 0;
+static int maxVoices = 64;
+static StealPolicy stealPolicy = StealPolicy::Oldest;
+
+static void voiceEffect(int channel, void* stream, int length, void* udata);
+
+static void voiceFinished(int channel, void* udata) {
+    if (!((Voice*)udata)->parking) Mix_PlayChannel(((Voice*)udata)->channelNumber, empty_chunk, -1);
+}
+
+// The functions below that call into SDL_mixer must be called with poolLock held and
+// without voiceLock, since SDL_mixer locks the audio device.
+
+// Gives a voice a mixer channel of its own. Free channels may belong to other users of SDL_mixer between
+// their sounds, so a new channel is always added past the existing ones, and kept busy from the start.
+static void claimChannel(Voice * voice) {
+    do {
+        voice->channelNumber = Mix_AllocateChannels(-1);
+        Mix_AllocateChannels(voice->channelNumber + 1);
+    } while (Mix_Playing(voice->channelNumber)); // a Mix_PlayChannel(-1) on another thread got there first
+    Mix_GroupChannel(voice->channelNumber, VOICE_GROUP);
+    Mix_PlayChannel(voice->channelNumber, empty_chunk, -1);
+}
+
+// Parks an idle voice by removing its effect, leaving the channel looping silence. The channel is never halted:
+// that would return it to SDL_mixer's free channels, where Mix_PlayChannel(-1) from the speaker or a tape drive
+// could take it before the voice is started again.
+static void parkVoice(Voice * voice) {
+    voice->parking = true;
+    Mix_UnregisterEffect(voice->channelNumber, voiceEffect);
+    voice->playing = false;
+}
+
+static void startVoice(Voice * voice) {
+    // If the parked channel was halted from outside and someone else started a sound on it, leave it to them.
+    if (Mix_Playing(voice->channelNumber) && Mix_GetChunk(voice->channelNumber) != empty_chunk) claimChannel(voice);
+    voice->parking = false;
+    Mix_RegisterEffect(voice->channelNumber, voiceEffect, voiceFinished, voice);
+    if (!Mix_Playing(voice->channelNumber)) Mix_PlayChannel(voice->channelNumber, empty_chunk, -1);
+    voice->playing = true;
+}
+
+static Voice * createVoice() {
+    Voice * voice = new Voice;
+    claimChannel(voice);
+    voices.push_back(voice);
+    return voice;
+}
+
+static void* parkIdleVoice(void* udata) {
+    Voice * voice = (Voice*)udata;
+    std::lock_guard<std::mutex> lock(poolLock);
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock2(voiceLock);
+        voice->parkQueued = false;
+        idle = voice->owner == NULL;
+    }
+    // Nothing can take the voice while poolLock is held.
+    if (idle && voice->playing) parkVoice(voice);
+    return NULL;
+}
+
+static void voiceEffect(int channel, void* stream, int length, void* udata) {
+    Voice * voice = (Voice*)udata;
+    std::lock_guard<std::mutex> lock(voiceLock);
+    if (voice->owner) {
+        if (generateWaveform(voice->owner, stream, length)) return;
+        // The channel went idle: give the voice back to the pool until a setter wakes the channel up.
+        voice->owner->voice = NULL;
+        voice->owner = NULL;
+    } else writeSilence(stream, length);
+    // SDL_mixer can't remove an effect from inside the effect, so the main thread does it.
+    if (!voice->parkQueued) {
+        voice->parkQueued = true;
+        func->queueTask(parkIdleVoice, voice, true);
+    }
+}
+
+// Must be called with poolLock and voiceLock held. Takes the lock of each owning channel to read its level.
+static Voice * findVictim() {
+    // Idle channels give up their voices regardless of the policy.
+    for (Voice * v : voices) {
+        if (!v->owner) return v;
+        std::lock_guard<std::mutex> lock(v->owner->lock);
+        if (channelIdle(v->owner)) return v;
+    }
+    Voice * victim = NULL;
+    switch (stealPolicy) {
+        case StealPolicy::None: break;
+        case StealPolicy::Oldest:
+            for (Voice * v : voices) if (!victim || v->allocated < victim->allocated) victim = v;
+            break;
+        case StealPolicy::Quietest: {
+            float quietest = 2.0;
+            for (Voice * v : voices) {
+                std::lock_guard<std::mutex> lock(v->owner->lock);
+                const float volume = max(v->owner->amplitude, v->owner->newAmplitude) * v->owner->bus->gain;
+                if (volume < quietest) {victim = v; quietest = volume;}
+            }
+            break;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Gives a channel a voice to play on, taking one from another channel if the pool is full.
+ * Must not be called with the channel's lock held.
+ * Returns: Whether the channel has a voice
+ */
+static bool acquireVoice(ChannelInfo * info) {
+    std::lock_guard<std::mutex> lock(poolLock);
+    Voice * voice = NULL;
+    {
+        std::lock_guard<std::mutex> lock2(voiceLock);
+        if (info->voice) return true;
+        for (Voice * v : voices) if (!v->owner) {voice = v; break;}
+        if (voice == NULL && (int)voices.size() >= maxVoices && (voice = findVictim()) == NULL) return false;
+    }
+    if (voice == NULL) voice = createVoice();
+    {
+        std::lock_guard<std::mutex> lock2(voiceLock);
+        if (voice->owner) {
+            // A stolen channel loses its place in the song, so stop it there.
+            std::lock_guard<std::mutex> lock3(voice->owner->lock);
+            voice->owner->voice = NULL;
+            voice->owner->songPlaying = false;
+        }
+        voice->owner = info;
+        voice->allocated = ++voiceCounter;
+        info->voice = voice;
+    }
+    if (!voice->playing) startVoice(voice);
+    return true;
+}
+
+static void releaseVoice(ChannelInfo * info) {
+    std::lock_guard<std::mutex> lock(poolLock);
+    Voice * voice;
+    {
+        std::lock_guard<std::mutex> lock2(voiceLock);
+        voice = info->voice;
+        if (voice) voice->owner = NULL;
+        info->voice = NULL;
+    }
+    if (voice && voice->playing) parkVoice(voice);
 }
 
-static void channelFinished(int channel, void* udata) {
-    if (!((ChannelInfo*)udata)->halting) Mix_PlayChannel(((ChannelInfo*)udata)->channelNumber, empty_chunk, -1);
+// Called after a setter changes a channel, so it starts playing if it's now audible.
+static void wakeChannel(ChannelInfo * info) {
+    if (!channelIdle(info)) acquireVoice(info);
 }
 
 static void ChannelInfo_destructor(Computer * comp, int id, void* data) {
     ChannelInfo * channels = (ChannelInfo*)data;
-    for (int i = 0; i < channels[0].channelCount; i++) {
-        channels[i].halting = true;
-        Mix_HaltChannel(channels[i].channelNumber);
-        Mix_UnregisterEffect(channels[i].channelNumber, generateWaveform);
-        Mix_GroupChannel(channels[i].channelNumber, -1);
-    }
+    for (int i = 0; i < channels[0].channelCount; i++) releaseVoice(&channels[i]);
+    delete channels[0].bus;
     delete[] channels;
 }
 
@@ -237,7 +591,7 @@ static int sound_setWaveType(lua_State *L) {
     ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
     std::string type = luaL_checkstring(L, 2);
     std::transform(type.begin(), type.end(), type.begin(), tolower);
-    std::lock_guard<std::mutex> lock(info->lock);
+    std::unique_lock<std::mutex> lock(info->lock);
     if (type == "none") info->wavetype = WaveType::None;
     else if (type == "sine") info->wavetype = WaveType::Sine;
     else if (type == "triangle") info->wavetype = WaveType::Triangle;
@@ -278,6 +632,8 @@ static int sound_setWaveType(lua_State *L) {
         info->position = 0.0;
     }
     else luaL_error(L, "bad argument #2 (invalid option '%s')", type.c_str());
+    lock.unlock();
+    wakeChannel(info);
     return 0;
 }
 
@@ -290,7 +646,7 @@ static int sound_getFrequency(lua_State *L) {
     const int channel = luaL_checkinteger(L, 1);
     if (channel < 1 || channel > NUM_CHANNELS) luaL_error(L, "bad argument #1 (channel out of range)");
     ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
-    lua_pushinteger(L, info->frequency);
+    lua_pushnumber(L, info->frequency);
     return 1;
 }
 
@@ -298,15 +654,49 @@ static int sound_getFrequency(lua_State *L) {
  * Sets the frequency of the wave on a channel.
  * 1: The channel to set (1 - NUM_CHANNELS)
  * 2: The frequency in Hz
+ * 3: The time to glide to the new frequency over in seconds (optional, defaults to the channel's portamento)
  */
 static int sound_setFrequency(lua_State *L) {
     const int channel = luaL_checkinteger(L, 1);
     if (channel < 1 || channel > NUM_CHANNELS) luaL_error(L, "bad argument #1 (channel out of range)");
     ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
-    lua_Integer frequency = luaL_checkinteger(L, 2);
+    double frequency = luaL_checknumber(L, 2);
     if (frequency < 0 || frequency > targetFrequency / 2) luaL_error(L, "bad argument #2 (frequency out of range)");
+    double time = luaL_optnumber(L, 3, -1);
+    {
+        std::lock_guard<std::mutex> lock(info->lock);
+        glideTo(info, frequency, time < 0 ? info->portamento : time * targetFrequency);
+    }
+    wakeChannel(info);
+    return 0;
+}
+
+/*
+ * Returns the portamento time of the channel.
+ * 1: The channel to check (1 - NUM_CHANNELS)
+ * Returns: The current portamento time in seconds
+ */
+static int sound_getPortamento(lua_State *L) {
+    const int channel = luaL_checkinteger(L, 1);
+    if (channel < 1 || channel > NUM_CHANNELS) luaL_error(L, "bad argument #1 (channel out of range)");
+    ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
+    lua_pushnumber(L, (double)info->portamento / targetFrequency);
+    return 1;
+}
+
+/*
+ * Sets the portamento time of a channel, which is how long frequency changes take to glide to the new frequency.
+ * 1: The channel to set (1 - NUM_CHANNELS)
+ * 2: The portamento time in seconds (0 to change immediately)
+ */
+static int sound_setPortamento(lua_State *L) {
+    const int channel = luaL_checkinteger(L, 1);
+    if (channel < 1 || channel > NUM_CHANNELS) luaL_error(L, "bad argument #1 (channel out of range)");
+    ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
+    double time = luaL_checknumber(L, 2);
+    if (time < 0.0) luaL_error(L, "bad argument #2 (time out of range)");
     std::lock_guard<std::mutex> lock(info->lock);
-    info->frequency = frequency;
+    info->portamento = time * targetFrequency;
     return 0;
 }
 
@@ -334,8 +724,11 @@ static int sound_setVolume(lua_State *L) {
     ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
     float amplitude = luaL_checknumber(L, 2);
     if (amplitude < 0.0 || amplitude > 1.0) luaL_error(L, "bad argument #2 (volume out of range)");
-    std::lock_guard<std::mutex> lock(info->lock);
-    info->newAmplitude = amplitude;
+    {
+        std::lock_guard<std::mutex> lock(info->lock);
+        info->newAmplitude = amplitude;
+    }
+    wakeChannel(info);
     return 0;
 }
 
@@ -420,18 +813,298 @@ static int sound_fadeOut(lua_State *L) {
     if (channel < 1 || channel > NUM_CHANNELS) luaL_error(L, "bad argument #1 (channel out of range)");
     ChannelInfo * info = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier] + (channel - 1);
     double time = luaL_checknumber(L, 2);
-    std::lock_guard<std::mutex> lock(info->lock);
-    if (time < -0.000001) {
-        info->fadeSamplesInit = 1 - info->amplitude;
-        info->fadeDirection = 1;
-        info->fadeSamples = info->fadeSamplesMax = -time * targetFrequency;
-    } else if (time < 0.000001) {
-        info->fadeSamplesInit = 0.0;
-        info->fadeSamples = info->fadeSamplesMax = 0;
-    } else {
-        info->fadeSamplesInit = info->amplitude;
-        info->fadeDirection = -1;
-        info->fadeSamples = info->fadeSamplesMax = time * targetFrequency;
+    {
+        std::lock_guard<std::mutex> lock(info->lock);
+        startFade(info, time);
+    }
+    wakeChannel(info);
+    return 0;
+}
+
+/*
+ * Returns the master volume of the computer.
+ * Returns: The current master volume
+ */
+static int sound_getMasterVolume(lua_State *L) {
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    lua_pushnumber(L, channels[0].bus->gain);
+    return 1;
+}
+
+/*
+ * Sets the master volume of the computer, which scales the volume of all channels.
+ * 1: The volume, from 0.0 to 1.0
+ */
+static int sound_setMasterVolume(lua_State *L) {
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    float gain = luaL_checknumber(L, 1);
+    if (gain < 0.0 || gain > 1.0) luaL_error(L, "bad argument #1 (volume out of range)");
+    channels[0].bus->gain = gain;
+    for (int i = 0; i < NUM_CHANNELS; i++) wakeChannel(&channels[i]);
+    return 0;
+}
+
+struct marker_data {
+    int channel;
+    double marker;
+};
+
+static std::string sound_marker(lua_State *L, void* userdata) {
+    marker_data * data = (marker_data*)userdata;
+    lua_pushinteger(L, data->channel + 1);
+    lua_pushnumber(L, data->marker);
+    delete data;
+    return "sound_marker";
+}
+
+// Called on the audio thread when a marker effect is reached.
+static void queueMarker(ChannelInfo * info, double marker) {
+    marker_data * data = new marker_data;
+    data->channel = info->id;
+    data->marker = marker;
+    func->queueEvent(info->comp, sound_marker, data);
+}
+
+static double checkSongNumber(lua_State *L, int idx, const char * field, double def, const char * where, int n) {
+    lua_getfield(L, idx, field);
+    double retval = def;
+    if (lua_isnumber(L, -1)) retval = lua_tonumber(L, -1);
+    else if (!lua_isnil(L, -1)) luaL_error(L, "bad field '%s' in %s %d (expected number, got %s)", field, where, n, luaL_typename(L, -1));
+    lua_pop(L, 1);
+    return retval;
+}
+
+static void loadSongInstrument(lua_State *L, int idx, int n, SongInstrument& inst) {
+    lua_getfield(L, idx, "wave");
+    if (lua_istable(L, -1)) {
+        inst.wavetype = WaveType::Custom;
+        for (int i = 1; ; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_isnil(L, -1)) {lua_pop(L, 1); break;}
+            if (i > 512) luaL_error(L, "bad wavetable in instrument %d (wavetable too large)", n);
+            if (!lua_isnumber(L, -1)) luaL_error(L, "bad point %d in wavetable for instrument %d (expected number, got %s)", i, n, luaL_typename(L, -1));
+            double point = lua_tonumber(L, -1);
+            if (point < -1.0 || point > 1.0) luaL_error(L, "bad point %d in wavetable for instrument %d (value out of range)", i, n);
+            inst.customWave.push_back(point);
+            lua_pop(L, 1);
+        }
+        if (inst.customWave.empty()) luaL_error(L, "bad wavetable in instrument %d (no points in wavetable)", n);
+    } else if (lua_isstring(L, -1)) {
+        std::string type = lua_tostring(L, -1);
+        std::transform(type.begin(), type.end(), type.begin(), tolower);
+        if (type == "none") inst.wavetype = WaveType::None;
+        else if (type == "sine") inst.wavetype = WaveType::Sine;
+        else if (type == "triangle") inst.wavetype = WaveType::Triangle;
+        else if (type == "sawtooth") inst.wavetype = WaveType::Sawtooth;
+        else if (type == "rsawtooth") inst.wavetype = WaveType::RSawtooth;
+        else if (type == "square") inst.wavetype = WaveType::Square;
+        else if (type == "noise") inst.wavetype = WaveType::Noise;
+        else if (type == "pitched_noise" || type == "pitchednoise" || type == "pnoise") inst.wavetype = WaveType::PitchedNoise;
+        else luaL_error(L, "bad wave type in instrument %d (invalid option '%s')", n, type.c_str());
+    } else if (!lua_isnil(L, -1)) luaL_error(L, "bad field 'wave' in instrument %d (expected string or table, got %s)", n, luaL_typename(L, -1));
+    lua_pop(L, 1);
+    inst.duty = checkSongNumber(L, idx, "duty", 0.5, "instrument", n);
+    if (inst.duty < 0.0 || inst.duty > 1.0) luaL_error(L, "bad field 'duty' in instrument %d (duty out of range)", n);
+    inst.volume = checkSongNumber(L, idx, "volume", 1.0, "instrument", n);
+    if (inst.volume < 0.0 || inst.volume > 1.0) luaL_error(L, "bad field 'volume' in instrument %d (volume out of range)", n);
+    inst.pan = checkSongNumber(L, idx, "pan", 0.0, "instrument", n);
+    if (inst.pan < -1.0 || inst.pan > 1.0) luaL_error(L, "bad field 'pan' in instrument %d (pan out of range)", n);
+    inst.release = checkSongNumber(L, idx, "release", 0.0, "instrument", n);
+    lua_getfield(L, idx, "interpolation");
+    if (lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), "linear") == 0) inst.interpolation = InterpolationMode::Linear;
+    lua_pop(L, 1);
+}
+
+/*
+ * Compiles a song table into a Song. Tempo and speed changes are applied in the order the
+ * song is read, so the timing of every event is known ahead of playback.
+ */
+static std::shared_ptr<Song> loadSong(lua_State *L, int idx, int numChannels) {
+    std::shared_ptr<Song> song = std::make_shared<Song>();
+    song->channels.resize(numChannels);
+    double tempo = checkSongNumber(L, idx, "tempo", 125, "song", 1);
+    int speed = checkSongNumber(L, idx, "speed", 6, "song", 1);
+    if (tempo <= 0 || speed <= 0) luaL_error(L, "bad argument #1 (tempo and speed must be positive)");
+    double samplesPerTick = targetFrequency * 2.5 / tempo;
+
+    lua_getfield(L, idx, "instruments");
+    if (lua_istable(L, -1)) {
+        for (int i = 1; ; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_isnil(L, -1)) {lua_pop(L, 1); break;}
+            if (!lua_istable(L, -1)) luaL_error(L, "bad instrument %d (expected table, got %s)", i, luaL_typename(L, -1));
+            song->instruments.emplace_back();
+            loadSongInstrument(L, lua_gettop(L), i, song->instruments.back());
+            lua_pop(L, 1);
+        }
+    } else if (!lua_isnil(L, -1)) luaL_error(L, "bad field 'instruments' (expected table, got %s)", luaL_typename(L, -1));
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "patterns");
+    if (!lua_istable(L, -1)) luaL_error(L, "bad field 'patterns' (expected table, got %s)", luaL_typename(L, -1));
+    const int patterns = lua_gettop(L);
+    lua_getfield(L, idx, "order");
+    if (!lua_istable(L, -1)) luaL_error(L, "bad field 'order' (expected table, got %s)", luaL_typename(L, -1));
+    const int order = lua_gettop(L);
+    lua_getfield(L, idx, "loop");
+    int loop = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : (lua_toboolean(L, -1) ? 1 : 0);
+    lua_pop(L, 1);
+
+    double time = 0.0;
+    for (int o = 1; ; o++) {
+        lua_rawgeti(L, order, o);
+        if (lua_isnil(L, -1)) {lua_pop(L, 1); break;}
+        lua_gettable(L, patterns);
+        if (!lua_istable(L, -1)) luaL_error(L, "bad pattern at order position %d (expected table, got %s)", o, luaL_typename(L, -1));
+        song->orderStart.push_back(time);
+        if (o == loop) song->loopStart = time;
+        for (int r = 1; ; r++) {
+            lua_rawgeti(L, -1, r);
+            if (lua_isnil(L, -1)) {lua_pop(L, 1); break;}
+            if (!lua_istable(L, -1)) luaL_error(L, "bad row %d at order position %d (expected table, got %s)", r, o, luaL_typename(L, -1));
+            const uint64_t rowTime = time;
+            song->rows.push_back({rowTime, o, r});
+            // Speed and tempo take effect on the row they're on.
+            for (int c = 1; c <= numChannels; c++) {
+                lua_rawgeti(L, -1, c);
+                if (lua_istable(L, -1)) {
+                    lua_getfield(L, -1, "effect");
+                    if (lua_isstring(L, -1)) {
+                        std::string effect = lua_tostring(L, -1);
+                        if (effect == "speed") {
+                            speed = checkSongNumber(L, -2, "param", speed, "row", r);
+                            if (speed <= 0) luaL_error(L, "bad speed on row %d at order position %d (speed must be positive)", r, o);
+                        } else if (effect == "tempo") {
+                            tempo = checkSongNumber(L, -2, "param", tempo, "row", r);
+                            if (tempo <= 0) luaL_error(L, "bad tempo on row %d at order position %d (tempo must be positive)", r, o);
+                            samplesPerTick = targetFrequency * 2.5 / tempo;
+                        }
+                    }
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+            }
+            for (int c = 1; c <= numChannels; c++) {
+                lua_rawgeti(L, -1, c);
+                if (lua_isnil(L, -1)) {lua_pop(L, 1); continue;}
+                if (!lua_istable(L, -1)) luaL_error(L, "bad cell %d on row %d at order position %d (expected table, got %s)", c, r, o, luaL_typename(L, -1));
+                std::vector<SongEvent>& events = song->channels[c-1];
+                std::string effect;
+                lua_getfield(L, -1, "effect");
+                if (lua_isstring(L, -1)) effect = lua_tostring(L, -1);
+                lua_pop(L, 1);
+                const double param = checkSongNumber(L, -1, "param", 0, "cell", c);
+                const uint64_t noteTime = effect == "delay" ? rowTime + (uint64_t)(param * samplesPerTick) : rowTime;
+                const double volume = checkSongNumber(L, -1, "volume", -1, "cell", c);
+                if (volume > 1.0) luaL_error(L, "bad volume in cell %d on row %d at order position %d (volume out of range)", c, r, o);
+                const int instrument = checkSongNumber(L, -1, "instrument", 0, "cell", c) - 1;
+                if (instrument >= (int)song->instruments.size()) luaL_error(L, "bad instrument in cell %d on row %d at order position %d (no such instrument)", c, r, o);
+                lua_getfield(L, -1, "note");
+                if (lua_isnumber(L, -1)) {
+                    const double freq = 440.0 * pow(2.0, (lua_tonumber(L, -1) - 69.0) / 12.0);
+                    if (freq > targetFrequency / 2) luaL_error(L, "bad note in cell %d on row %d at order position %d (frequency out of range)", c, r, o);
+                    const unsigned int glide = effect == "glide" ? param * samplesPerTick : 0;
+                    events.push_back({noteTime, SongEventType::Note, instrument, freq, volume < 0 ? 1.0f : (float)volume, glide});
+                } else if (lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), "off") == 0) {
+                    events.push_back({noteTime, SongEventType::NoteOff, -1, 0, 0});
+                } else if (!lua_isnil(L, -1)) luaL_error(L, "bad note in cell %d on row %d at order position %d (expected number or 'off', got %s)", c, r, o, luaL_typename(L, -1));
+                else if (volume >= 0) events.push_back({noteTime, SongEventType::Volume, -1, 0, (float)volume});
+                lua_pop(L, 1);
+                if (effect == "cut") events.push_back({rowTime + (uint64_t)(param * samplesPerTick), SongEventType::NoteOff, -1, 0, 0});
+                else if (effect == "pan") {
+                    if (param < -1.0 || param > 1.0) luaL_error(L, "bad pan in cell %d on row %d at order position %d (pan out of range)", c, r, o);
+                    events.push_back({rowTime, SongEventType::Pan, -1, param, 0});
+                } else if (effect == "fade") events.push_back({rowTime, SongEventType::Fade, -1, param, 0});
+                else if (effect == "marker") events.push_back({rowTime, SongEventType::Marker, -1, param, 0});
+                else if (!effect.empty() && effect != "delay" && effect != "glide" && effect != "speed" && effect != "tempo")
+                    luaL_error(L, "bad effect in cell %d on row %d at order position %d (invalid option '%s')", c, r, o, effect.c_str());
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+            time += speed * samplesPerTick;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    if (song->rows.empty()) luaL_error(L, "bad argument #1 (song has no rows)");
+    song->length = time;
+    song->loop = loop > 0 && loop <= (int)song->orderStart.size();
+    // Delayed and cut notes can land out of order.
+    for (std::vector<SongEvent>& events : song->channels)
+        std::stable_sort(events.begin(), events.end(), [](const SongEvent& a, const SongEvent& b) {return a.time < b.time;});
+    return song;
+}
+
+/*
+ * Loads a song into the sequencer, stopping any song currently playing.
+ * 1: The song to load (see README for the format)
+ */
+static int sound_loadSong(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    std::shared_ptr<Song> song = loadSong(L, 1, NUM_CHANNELS);
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        std::lock_guard<std::mutex> lock(channels[i].lock);
+        channels[i].song = song;
+        channels[i].songPlaying = false;
+        channels[i].songInstrument = -1;
+    }
+    return 0;
+}
+
+/*
+ * Starts playing the loaded song.
+ * 1: The order position to start at (optional, defaults to 1)
+ */
+static int sound_playSong(lua_State *L) {
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    if (!channels[0].song) luaL_error(L, "no song loaded");
+    const int order = luaL_optinteger(L, 1, 1);
+    if (order < 1 || order > (int)channels[0].song->orderStart.size()) luaL_error(L, "bad argument #1 (order position out of range)");
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        const std::vector<SongEvent>& events = channels[i].song->channels[i];
+        // Channels without any notes don't need to be woken up.
+        if (events.empty()) continue;
+        {
+            std::lock_guard<std::mutex> lock(channels[i].lock);
+            channels[i].songPosition = channels[i].song->orderStart[order-1];
+            channels[i].songEvent = std::lower_bound(events.begin(), events.end(), channels[i].songPosition, [](const SongEvent& ev, uint64_t t) {return ev.time < t;}) - events.begin();
+            channels[i].songPlaying = true;
+        }
+        wakeChannel(&channels[i]);
+    }
+    return 0;
+}
+
+/*
+ * Stops the song and silences all channels it was playing on.
+ */
+static int sound_stopSong(lua_State *L) {
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        std::lock_guard<std::mutex> lock(channels[i].lock);
+        if (!channels[i].songPlaying) continue;
+        channels[i].songPlaying = false;
+        if (!channels[i].song->channels[i].empty()) channels[i].newAmplitude = 0;
+    }
+    return 0;
+}
+
+/*
+ * Returns the current position of the song.
+ * Returns: The order position and row being played, or nil if no song is playing
+ */
+static int sound_getSongPosition(lua_State *L) {
+    ChannelInfo * channels = (ChannelInfo*)get_comp(L)->userdata[ChannelInfo::identifier];
+    for (int i = 0; i < NUM_CHANNELS; i++) {
+        std::lock_guard<std::mutex> lock(channels[i].lock);
+        if (!channels[i].songPlaying) continue;
+        const std::vector<SongRow>& rows = channels[i].song->rows;
+        auto it = std::upper_bound(rows.begin(), rows.end(), channels[i].songPosition, [](uint64_t t, const SongRow& row) {return t < row.time;});
+        if (it != rows.begin()) --it;
+        lua_pushinteger(L, it->order);
+        lua_pushinteger(L, it->row);
+        return 2;
     }
     return 0;
 }
@@ -442,6 +1115,8 @@ static luaL_Reg sound_lib[] = {
     {"setWaveType", sound_setWaveType},
     {"getFrequency", sound_getFrequency},
     {"setFrequency", sound_setFrequency},
+    {"getPortamento", sound_getPortamento},
+    {"setPortamento", sound_setPortamento},
     {"getVolume", sound_getVolume},
     {"setVolume", sound_setVolume},
     {"getPan", sound_getPan},
@@ -449,6 +1124,12 @@ static luaL_Reg sound_lib[] = {
     {"getInterpolation", sound_getInterpolation},
     {"setInterpolation", sound_setInterpolation},
     {"fadeOut", sound_fadeOut},
+    {"getMasterVolume", sound_getMasterVolume},
+    {"setMasterVolume", sound_setMasterVolume},
+    {"loadSong", sound_loadSong},
+    {"playSong", sound_playSong},
+    {"stopSong", sound_stopSong},
+    {"getSongPosition", sound_getSongPosition},
     {NULL, NULL}
 };
 
@@ -462,7 +1143,12 @@ PluginInfo * plugin_init(const PluginFunctions * func, const path_t& path) {
     empty_chunk = Mix_QuickLoad_RAW(empty_audio, 32);
     rng.seed(std::chrono::system_clock::now().time_since_epoch().count());
     ::func = func;
-    if (func->structure_version >= 2) func->registerConfigSetting("sound.numChannels", CONFIG_TYPE_INTEGER, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+    markerHandler = queueMarker;
+    if (func->structure_version >= 2) {
+        func->registerConfigSetting("sound.numChannels", CONFIG_TYPE_INTEGER, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+        func->registerConfigSetting("sound.maxVoices", CONFIG_TYPE_INTEGER, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+        func->registerConfigSetting("sound.voiceStealing", CONFIG_TYPE_STRING, [](const std::string&, void*)->int{return CONFIG_EFFECT_REOPEN;}, NULL);
+    }
     return &info;
 }
 
@@ -475,22 +1161,25 @@ int luaopen_sound(lua_State *L) {
     if (func->structure_version >= 2) { // Plugin config is broken on v2.5-v2.5.2
         try {num_channels = func->getConfigSettingInt("sound.numChannels");}
         catch (...) {func->setConfigSettingInt("sound.numChannels", num_channels);}
+        try {maxVoices = func->getConfigSettingInt("sound.maxVoices");}
+        catch (...) {func->setConfigSettingInt("sound.maxVoices", maxVoices);}
+        try {
+            std::string policy = func->getConfigSetting("sound.voiceStealing");
+            if (policy == "none") stealPolicy = StealPolicy::None;
+            else if (policy == "quietest") stealPolicy = StealPolicy::Quietest;
+            else stealPolicy = StealPolicy::Oldest;
+        } catch (...) {func->setConfigSetting("sound.voiceStealing", "oldest");}
     }
     if (comp->userdata.find(ChannelInfo::identifier) == comp->userdata.end()) {
+        // No mixer channels are allocated here; channels get a voice from the pool once they're used.
         ChannelInfo * channels = new ChannelInfo[num_channels];
+        SoundBus * bus = new SoundBus;
         Mix_QuerySpec(&targetFrequency, &targetFormat, &targetChannels);
-        Mix_AllocateChannels(Mix_AllocateChannels(-1) + num_channels);
         for (int i = 0; i < num_channels; i++) {
             channels[i].id = i;
             channels[i].channelCount = num_channels;
-            channels[i].channelNumber = Mix_GroupAvailable(-1);
-            while (channels[i].channelNumber == -1) {
-                Mix_AllocateChannels(Mix_AllocateChannels(-1) + 1);
-                channels[i].channelNumber = Mix_GroupAvailable(-1);
-            }
-            Mix_GroupChannel(channels[i].channelNumber, channelGroup(comp->id));
-            Mix_RegisterEffect(channels[i].channelNumber, generateWaveform, channelFinished, &channels[i]);
-            Mix_PlayChannel(channels[i].channelNumber, empty_chunk, -1);
+            channels[i].comp = comp;
+            channels[i].bus = bus;
         }
         comp->userdata[ChannelInfo::identifier] = channels;
         comp->userdata[ChannelInfo::identifier+1] = (void*)(ptrdiff_t)num_channels;
@@ -509,3 +1198,5 @@ void plugin_deinit(PluginInfo * info) {
     //Mix_FreeChunk(empty_chunk);
 }
 }
+
+#endif // SOUND_SYNTH_ONLY